@@ -1,5 +1,6 @@
 #ifndef RENDER_RENDERENGINE_H
 #define RENDER_RENDERENGINE_H
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <memory>
@@ -8,8 +9,14 @@
 #include <functional>
 #include <thread>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include "scene.h"
-#define NUM_THREADS  16// 线程数
+#include "tile_scheduler.h"
+#include "light_sampler.h"
+#include "sampler.h"
+#include "wavefront.h"
+#include "thread_affinity.h"
 
 enum class SampleMethod {
     BRDF = 0,
@@ -18,10 +25,16 @@ enum class SampleMethod {
     NEE = 3,
     MIS = 4
 };
+// 自适应采样：根据每个像素的方差估计决定采样数
+struct AdaptiveSampling {
+    bool enabled = false;
+    int min_spp = 16;        // 每个像素至少的采样数
+    int batch_spp = 8;       // 误差没有达到要求时，每次追加的采样数
+    double threshold = 0.02; // 误差阈值：亮度均值的标准误差 / 亮度均值
+};
 //TODO: 0.DEBUG MIS,
 //TODO: 1.重构 BRDF 和 glass材质
 //TODO: 2.体渲染
-//TODO: 3.递归光线追踪--->迭代光线追踪
 class RenderEngine{
 public:
     RenderEngine(Scene scene, int width, int height):
@@ -35,20 +48,144 @@ public:
         this->scene = s;
         this->width = s.width;
         this->height = s.height;
+        resetAccumulation();
     }
     void setProgressCallback(const std::function<void(int)> &callback) {
         progressCallback = callback;
     }
+    // 渲染线程数，0表示使用全部硬件线程(std::thread::hardware_concurrency)
+    void setThreadCount(int n) {
+        thread_count = n > 0 ? n : 0;
+    }
+    int getThreadCount() const {
+        return thread_count > 0 ? thread_count : std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+    /*  把渲染线程绑定到处理器上，见cpu_topology::cpu_for_worker
+
+        线程均匀地分布在所有NUMA结点上，每个线程的块缓冲区和临时内存由它自己在绑定之后分配，
+        按首次访问(first-touch)落在它所在的结点上。渲染结束后恢复原来的亲和性。
+    */
+    void setThreadPinning(bool enabled) {
+        pin_threads = enabled;
+    }
+    // 分块大小(像素)，每个块是调度的最小单位
+    void setTileSize(int size) {
+        tile_size = size > 0 ? size : 1;
+    }
+    // 随机数种子：相同的种子得到逐位相同的图像，与线程数无关
+    void setSeed(uint64_t s) {
+        seed = s;
+    }
+    // 采样器：像素、镜头、光源和BRDF采样使用的随机数序列，默认为独立的伪随机数
+    void setSampler(sampler_type type) {
+        sampler_kind = type;
+    }
+    /*  wavefront渲染：每个块的路径分批地按阶段执行(见wavefront.h)，batch_size为每批的路径数上限
+
+        只用于NEE和MIS积分器，结果与逐条路径渲染逐位相同；其他积分器和自适应采样仍然逐条路径渲染。
+    */
+    void setWavefront(bool enabled, int batch_size = 1 << 14) {
+        wavefront = enabled;
+        wavefront_batch = batch_size > 0 ? batch_size : 1;
+    }
+    // wavefront渲染中，相机光线和阴影光线每最多bvh_packet::max_size条作为一个包一起遍历BVH
+    void setRayPackets(bool enabled) {
+        ray_packets = enabled;
+    }
+    // 每条路径的最大弹射次数
+    void setMaxDepth(int depth) {
+        max_depth = depth > 0 ? depth : 1;
+    }
+    // 从第depth次弹射开始，俄罗斯轮盘赌的概率由路径通量决定
+    void setRussianRouletteDepth(int depth) {
+        rr_depth = depth;
+    }
+    // 开启自适应采样后，render()的spp参数作为每个像素采样数的上限
+    void setAdaptiveSampling(const AdaptiveSampling &a) {
+        adaptive = a;
+    }
+    // 上一次自适应渲染中每个像素的采样数
+    const std::vector<int> &getSampleCounts() const {
+        return sample_counts;
+    }
+    // 上一次渲染中每个块的耗时
+    const std::vector<Tile> &getTileTimings() const {
+        return tile_timings;
+    }
     void render(int spp=16, SampleMethod method = SampleMethod::BRDF,const std::string& img_name="./output/img.png",bool isOpenMP=true);
 
+    /*  渐进式渲染:
+
+        每一遍为所有像素增加pass_spp个采样，累加到持久的缓冲区中，每一遍结束后写出图像并调用snapshotCallback。
+        累计到max_spp个采样或调用stop()后返回；再次调用会在已有的结果上继续累加，直到resetAccumulation()或更换场景。
+    */
+    void renderProgressive(int pass_spp, int max_spp, SampleMethod method = SampleMethod::BRDF,
+                           const std::string& img_name="./output/img.png", bool isOpenMP=true);
+    // 以下三个函数可以在其他线程中调用
+    void pause();   // 当前的块完成后暂停
+    void resume();
+    void stop();    // 当前这一遍完成后结束渐进式渲染
+    bool isPaused() const {
+        return paused;
+    }
+    void resetAccumulation() {
+        accum_buffer.clear();
+        accum_spp = 0;
+    }
+    // 累加缓冲区保存的是每个像素的采样之和，除以getAccumulatedSpp()得到当前的估计值
+    const std::vector<color> &getAccumulation() const {
+        return accum_buffer;
+    }
+    int getAccumulatedSpp() const {
+        return accum_spp;
+    }
+    void setSnapshotCallback(const std::function<void(const std::vector<color>&, int)> &callback) {
+        snapshotCallback = callback;
+    }
+
 private:
-    color computePixelColor(int i, int j, int spp, SampleMethod method)const;
-    color ray_color(const ray &r,SampleMethod method)const;
-    color BRDF_sample(const ray &r)const;
-    color light_sample(const ray &r)const;
-    color Mixture_sample(const ray &r)const;
-    color NEE_sample(const ray &r,int depth,bool is_shadow= false)const;
-    color Muliti_Importance_sample(const ray &r,int depth, double emitted_weight,bool is_shadow= false)const;
+    // 每个线程在一遍渲染中使用的临时内存，由该线程自己分配
+    struct WorkerScratch {
+        std::unique_ptr<sampler> smp;
+        std::vector<color> tile_color; // 当前块的像素，块完成后累加到图像中
+        PathBatch batch;               // wavefront渲染的路径状态
+    };
+
+    color computeSample(int i, int j, int s, SampleMethod method, sampler &smp)const;
+    color computePixelColor(int i, int j, int spp, SampleMethod method, sampler &smp, int first_sample = 0)const;
+    // 自适应采样，返回实际的采样数
+    int computePixelColorAdaptive(int i, int j, int max_spp, SampleMethod method, sampler &smp,
+                                  color &pixel_color)const;
+    void renderTile(const Tile &tile, int spp, int first_sample, SampleMethod method, WorkerScratch &scratch,
+                    std::vector<color> &img, std::vector<int> *counts)const;
+    // 为img中的每个像素累加第[first_sample, first_sample+spp)个采样
+    // counts不为空时使用自适应采样，spp为上限，counts记录每个像素的采样数
+    void renderPass(int spp, int first_sample, SampleMethod method, bool isOpenMP, std::vector<color> &img,
+                    int spp_done, int spp_total, std::vector<int> *counts = nullptr);
+    // 结果写入scratch.tile_color
+    void renderTileWavefront(const Tile &tile, int spp, int first_sample, SampleMethod method,
+                             WorkerScratch &scratch)const;
+    // wavefront的各个阶段，路径在batch中的下标k对应块内第(first_path + k)/spp个像素的第(first_path + k)%spp个采样
+    void wavefrontGenerate(PathBatch &batch, const Tile &tile, int first_path, int spp, int first_sample,
+                           sampler &smp)const;
+    void wavefrontIntersect(PathBatch &batch, int bounce, SampleMethod method, sampler &smp)const;
+    void wavefrontShade(PathBatch &batch, int bounce, SampleMethod method, sampler &smp)const;
+    void wavefrontShadow(PathBatch &batch, SampleMethod method, sampler &smp)const;
+    void waitIfPaused();
+    void printThreadInfo(bool isOpenMP)const;
+    // 渲染开始时在scene.world之上构建顶层BVH，并构建光源的采样结构
+    void buildAccel();
+    color ray_color(const ray &r,SampleMethod method, sampler &smp)const;
+    color BRDF_sample(const ray &r, sampler &smp)const;
+    color light_sample(const ray &r, sampler &smp)const;
+    color Mixture_sample(const ray &r, sampler &smp)const;
+    color NEE_sample(const ray &r, sampler &smp)const;
+    color Muliti_Importance_sample(const ray &r, sampler &smp)const;
+    color trace_shadow(const ray &r, const light_record &ls, double weight, double p_RR, double t_min)const;
+    // 已知阴影光线被遮挡时，穿过透明物体和介质继续追踪
+    color trace_shadow_blocked(const ray &r, double weight, double p_RR, double t_min)const;
+    // 返回俄罗斯轮盘赌中路径继续的概率
+    double russian_roulette(int bounce, const color &beta, double p_RR)const;
 
     void balance_heuristic(double f_pdf, double g_pdf, double &weight_f, double &weight_g,int beta=1)const{
         if(beta!=1) {
@@ -63,6 +200,32 @@ public:
     int width{};
     int height{};
     std::function<void(int)> progressCallback;
+private:
+    int thread_count = 0;
+    bool pin_threads = false;
+    int tile_size = 16;
+    uint64_t seed = 0;
+    sampler_type sampler_kind = sampler_type::Independent;
+    std::unique_ptr<sampler> sampler_proto; // 每次渲染开始时创建，每个块复制一份
+    bool wavefront = false;
+    int wavefront_batch = 1 << 14;
+    bool ray_packets = true;
+    int max_depth = 50;
+    int rr_depth = 3;
+    std::vector<Tile> tile_timings;
+    shared_ptr<top_level_bvh> world;   // 积分器求交时使用的场景
+    light_sampler lights;              // 由scene.lights构建，按功率选择光源
+    bool shadow_transmissive = true;   // 被遮挡的阴影光线是否需要完整地追踪
+    AdaptiveSampling adaptive;
+    std::vector<int> sample_counts;
+
+    std::vector<color> accum_buffer;
+    int accum_spp = 0;
+    std::function<void(const std::vector<color>&, int)> snapshotCallback;
+    std::atomic<bool> paused{false};
+    std::atomic<bool> stop_requested{false};
+    std::mutex pause_lock;
+    std::condition_variable pause_cv;
 };
 
 #endif //RENDER_RENDERENGINE_H
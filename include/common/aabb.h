@@ -12,6 +12,23 @@ class aabb{
 
         //aabb hit:判断光线是否与包围盒相交
         bool hit(const ray& r, double tmin, double tmax) const;
+        double surface_area() const {
+            vecf3 d = maximum - minimum;
+            return 2.0 * (double(d.x()) * d.y() + double(d.y()) * d.z() + double(d.z()) * d.x());
+        }
+        //inv_dir为光线方向的倒数，由调用者预先计算；方向为负时近处的平面是最大点，不需要交换t0和t1
+        bool hit(const pointf3& origin, const vecf3& inv_dir, double tmin, double tmax) const {
+            for (int a = 0; a < 3; a++) {
+                const bool neg = inv_dir[a] < 0.0f;
+                double t0 = ((neg ? maximum[a] : minimum[a]) - origin[a]) * inv_dir[a];
+                double t1 = ((neg ? minimum[a] : maximum[a]) - origin[a]) * inv_dir[a];
+                tmin = t0 > tmin ? t0 : tmin;
+                tmax = t1 < tmax ? t1 : tmax;
+                if (tmax <= tmin)
+                    return false;
+            }
+            return true;
+        }
     public:
     //box可以看成是两个点的集合，一个最小点，一个最大点，描述了一个长方体
         pointf3 minimum;
@@ -0,0 +1,111 @@
+#ifndef RENDER_AFFINE_H
+#define RENDER_AFFINE_H
+#include "common.h"
+#include "aabb.h"
+
+/*  affine3: 4x3的仿射变换矩阵，p' = L*p + t
+
+    m[i][0..2]为线性部分L的第i行，m[i][3]为平移t。
+    法向量按 L^-T 变换，所以需要同时保存逆矩阵，见 transform_normal。
+*/
+struct affine3 {
+    double m[3][4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}};
+
+    static affine3 identity() { return affine3(); }
+    static affine3 translation(const vecf3 &offset) {
+        affine3 a;
+        for (int i = 0; i < 3; i++)
+            a.m[i][3] = offset[i];
+        return a;
+    }
+    static affine3 scaling(const vecf3 &s) {
+        affine3 a;
+        for (int i = 0; i < 3; i++)
+            a.m[i][i] = s[i];
+        return a;
+    }
+    // 绕坐标轴axis(0,1,2分别为x,y,z)旋转angle度，方向与rotate相同
+    static affine3 rotation(int axis, double angle) {
+        const double radians = degrees_to_radians(angle);
+        const double c = cos(radians), s = sin(radians);
+        const int c1 = (axis + 1) % 3, c2 = (axis + 2) % 3;
+        affine3 a;
+        a.m[c1][c1] = c;
+        a.m[c1][c2] = -s;
+        a.m[c2][c1] = s;
+        a.m[c2][c2] = c;
+        return a;
+    }
+
+    // 先做b再做a
+    friend affine3 operator*(const affine3 &a, const affine3 &b) {
+        affine3 r;
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < 4; j++) {
+                double v = j == 3 ? a.m[i][3] : 0.0;
+                for (int k = 0; k < 3; k++)
+                    v += a.m[i][k] * b.m[k][j];
+                r.m[i][j] = v;
+            }
+        }
+        return r;
+    }
+
+    double determinant() const {
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    // 线性部分不可逆时结果没有意义，调用者需要保证det != 0
+    affine3 inverse() const {
+        const double inv_det = 1.0 / determinant();
+        affine3 r;
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+        for (int i = 0; i < 3; i++)
+            r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3] + r.m[i][2] * m[2][3]);
+        return r;
+    }
+
+    pointf3 point(const pointf3 &p) const {
+        return pointf3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+                       m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+                       m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+    }
+    vecf3 vector(const vecf3 &v) const {
+        return vecf3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                     m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                     m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+    // 用本矩阵的逆矩阵inv变换法向量：n' = inv^T * n
+    static vecf3 transform_normal(const affine3 &inv, const vecf3 &n) {
+        return vecf3(inv.m[0][0] * n[0] + inv.m[1][0] * n[1] + inv.m[2][0] * n[2],
+                     inv.m[0][1] * n[0] + inv.m[1][1] * n[1] + inv.m[2][1] * n[2],
+                     inv.m[0][2] * n[0] + inv.m[1][2] * n[1] + inv.m[2][2] * n[2]);
+    }
+    // 变换后的包围盒：对每个轴分别取线性部分各项的最小和最大值
+    aabb box(const aabb &b) const {
+        pointf3 lo, hi;
+        for (int i = 0; i < 3; i++) {
+            double l = m[i][3], h = m[i][3];
+            for (int k = 0; k < 3; k++) {
+                double e0 = m[i][k] * b.min()[k], e1 = m[i][k] * b.max()[k];
+                l += fmin(e0, e1);
+                h += fmax(e0, e1);
+            }
+            lo.e[i] = static_cast<float>(l);
+            hi.e[i] = static_cast<float>(h);
+        }
+        return aabb(lo, hi);
+    }
+};
+
+#endif //RENDER_AFFINE_H
@@ -42,6 +42,14 @@ class camera{
             return ray( origin+offset, 
                         lower_left_corner + s* horizontal + t * vertical - origin - offset,random_double(time0, time1));
         }
+        // 镜头上的位置和快门时间由sampler给出
+        ray get_ray(double s, double t, const pointd2 &lens, double time_u)const{
+            vecf3 rd = lens_radius * uniform_in_unit_disk(lens);
+            vecf3 offset = u * rd.x() + v * rd.y();
+            return ray( origin+offset,
+                        lower_left_corner + s* horizontal + t * vertical - origin - offset,
+                        time0 + time_u * (time1 - time0));
+        }
     private:
         pointf3 origin;
         pointf3 lower_left_corner;
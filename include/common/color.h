@@ -3,9 +3,15 @@
 
 #include "common.h"
 #include "rtw_stb_image.h"
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
+// 亮度(Rec.709)
+inline double luminance(const color &c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline void write_color(std::ostream &out, color pixel_color) {
     // Write the translated [0,255] value of each color component.
     out << static_cast<int>(255.999 * pixel_color.x()) << ' '
@@ -34,9 +40,10 @@ inline void write_color(std::ostream& out, color pixel_color, int samples_per_pi
         << static_cast<int>(256 * clamp(b, 0.0, 0.999)) << '\n';
 }
 
-inline void write_img(const char* filename, int width ,int height,const std::vector<color>& img, int samples_per_pixel) {
-    int num_channels = 3;
-    char *data = new char[width * height * num_channels];
+// 把累加的颜色除以采样数并做gamma校正，转换为8位RGB写入data(width*height*3字节)，第一行是图像的最上面一行
+// samples_per_pixel(k) 返回第k个像素的采样数
+template <typename SppFn>
+inline void to_rgb8(int width, int height, const std::vector<color>& img, SppFn samples_per_pixel, unsigned char* data) {
     int index = 0;
     for (int j = height - 1; j >= 0; --j) {
         for (int i = 0; i < width; ++i) {
@@ -50,21 +57,35 @@ inline void write_img(const char* filename, int width ,int height,const std::vec
             if (b != b) b = 0.0;
 
             // Divide the color by the number of samples and gamma-correct for gamma=2.0.
-            auto scale = 1.0 / samples_per_pixel;
+            auto scale = 1.0 / samples_per_pixel(j * width + i);
             r = sqrt(scale * r);
             g = sqrt(scale * g);
             b = sqrt(scale * b);
 
             // Write the translated [0,255] value of each color component.
-            data[index++] = static_cast<int>(256 * clamp(r, 0.0, 0.999));
-            data[index++] = static_cast<int>(256 * clamp(g, 0.0, 0.999));
-            data[index++] = static_cast<int>(256 * clamp(b, 0.0, 0.999));
+            data[index++] = static_cast<unsigned char>(256 * clamp(r, 0.0, 0.999));
+            data[index++] = static_cast<unsigned char>(256 * clamp(g, 0.0, 0.999));
+            data[index++] = static_cast<unsigned char>(256 * clamp(b, 0.0, 0.999));
         }
     }
+}
 
-    stbi_write_png(filename, width, height, num_channels, data, width * num_channels);
+template <typename SppFn>
+inline void write_img(const char* filename, int width ,int height,const std::vector<color>& img, SppFn samples_per_pixel) {
+    int num_channels = 3;
+    std::vector<unsigned char> data(width * height * num_channels);
+    to_rgb8(width, height, img, samples_per_pixel, data.data());
+    stbi_write_png(filename, width, height, num_channels, data.data(), width * num_channels);
+}
+
+// 所有像素的采样数相同
+inline void write_img(const char* filename, int width ,int height,const std::vector<color>& img, int samples_per_pixel) {
+    write_img(filename, width, height, img, [samples_per_pixel](int) { return samples_per_pixel; });
+}
 
-    delete [] data;
+// 自适应采样时每个像素的采样数不同
+inline void write_img(const char* filename, int width ,int height,const std::vector<color>& img, const std::vector<int>& samples_per_pixel) {
+    write_img(filename, width, height, img, [&samples_per_pixel](int k) { return std::max(samples_per_pixel[k], 1); });
 }
 
 #endif
\ No newline at end of file
@@ -2,10 +2,12 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
-#include <random>
-#include <cmath>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 //添加一些常用的变量、常数、函数和头文件
 
@@ -26,11 +28,75 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// PCG32 随机数生成器 (https://www.pcg-random.org)
+// 状态只有16字节，生成一个数只需一次乘加和一次位旋转
+class pcg32 {
+public:
+    pcg32() { seed(0x853c49e6748fea9bULL, 0xda3e39cb94b95bdbULL); }
+
+    // initstate决定起始位置，initseq决定使用哪一条随机数流
+    void seed(uint64_t initstate, uint64_t initseq = 1) {
+        state = 0u;
+        inc = (initseq << 1u) | 1u;
+        next_uint();
+        state += initstate;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t oldstate = state;
+        state = oldstate * 6364136223846793005ULL + inc;
+        auto xorshifted = static_cast<uint32_t>(((oldstate >> 18u) ^ oldstate) >> 27u);
+        auto rot = static_cast<uint32_t>(oldstate >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+
+    // [0,1)
+    double next_double() {
+        return next_uint() * 0x1p-32;
+    }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+// 64位整数的哈希 (splitmix64 的最后一步)，用于从像素坐标生成种子
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= v >> 33;
+    return v;
+}
+
+// 最低的为1的位的下标，m不能为0。用于遍历光线包的掩码
+inline int lowest_set_bit(uint32_t m) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return static_cast<int>(i);
+#else
+    return __builtin_ctz(m);
+#endif
+}
+
+// 每个线程有自己的生成器，避免多线程之间的数据竞争和缓存行争用
+inline pcg32 &thread_rng() {
+    thread_local pcg32 rng;
+    return rng;
+}
+
+// 设置当前线程的随机数流。渲染时每个像素的每个采样都用(像素, 采样序号)重新播种，
+// 这样结果与线程数和调度顺序无关，可以逐位复现
+inline void seed_random(uint64_t key, uint64_t stream) {
+    thread_rng().seed(mix_bits(key), stream);
+}
+
 // Returns a random real in [0,1).
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return thread_rng().next_double();
 }
 // Returns a random real in [min,max).
 inline double random_double(double min, double max) {
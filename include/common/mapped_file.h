@@ -0,0 +1,47 @@
+#ifndef RENDER_MAPPED_FILE_H
+#define RENDER_MAPPED_FILE_H
+#include <cstddef>
+#include <string>
+
+/*  mapped_file: 只读地把整个文件映射到内存中
+
+    POSIX下使用mmap，Windows下使用CreateFileMapping；对象销毁时解除映射。
+    空文件打开成功，但data()为nullptr。
+*/
+class mapped_file {
+public:
+    mapped_file() = default;
+    explicit mapped_file(const std::string &path) { open(path); }
+    ~mapped_file() { close(); }
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    mapped_file(mapped_file &&other) noexcept { swap(other); }
+    mapped_file &operator=(mapped_file &&other) noexcept {
+        if (this != &other) {
+            close();
+            swap(other);
+        }
+        return *this;
+    }
+
+    // 打开失败时返回false
+    bool open(const std::string &path);
+    void close();
+
+    bool is_open() const { return opened; }
+    const char *data() const { return static_cast<const char *>(addr); }
+    size_t size() const { return length; }
+
+private:
+    void swap(mapped_file &other) noexcept;
+
+    void *addr = nullptr;
+    size_t length = 0;
+    bool opened = false;
+#ifdef _WIN32
+    void *file_handle = nullptr;
+    void *mapping_handle = nullptr;
+#endif
+};
+
+#endif //RENDER_MAPPED_FILE_H
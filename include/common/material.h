@@ -16,7 +16,7 @@ struct scatter_record {
     bool is_medium = false;
     bool is_refract = false;
     color attenuation;//材质的吸收系数
-    shared_ptr<pdf> pdf_ptr;//散射光线的概率分布函数
+    scatter_pdf dir_pdf;//散射光线的概率分布函数，镜面反射时为空
 };
 
 enum class material_type {
@@ -38,6 +38,10 @@ public:
         const ray &r_in, const hit_record &rec, double u, double v, const pointf3 &p) const {
         return color(0, 0, 0);
     }
+    // 自发光的大致强度，用于按功率选择光源
+    virtual color average_emitted() const {
+        return color(0, 0, 0);
+    }
     // 不同的材料对光线有不同的散射方程和颜色吸收系数, 二者组成了BRDF
     virtual bool scatter(
         const ray &r_in,
@@ -78,7 +82,7 @@ public:
 
         srec.is_specular = false;
         srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<cosin_pdf>(rec.normal);
+        srec.dir_pdf = scatter_pdf::cosine(rec.normal);
         return true;
     }
 
@@ -114,7 +118,7 @@ public:
         srec.scatter_ray = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
         srec.attenuation = albedo;
         srec.is_specular = true;
-        srec.pdf_ptr = nullptr;
+        srec.dir_pdf = scatter_pdf();
         return true;
     }
 
@@ -141,7 +145,7 @@ public:
         ) const override {
 
         srec.attenuation = color(1.0, 1.0, 1.0); // 透明
-        srec.pdf_ptr = nullptr;
+        srec.dir_pdf = scatter_pdf();
         double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;  // 判断是进入还是离开物体
         vecf3 unit_direction = unit_vector(r_in.direction());
         double cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);  // cosθ
@@ -203,6 +207,10 @@ public:
             return emitt->value(u, v, p);
         return color(0, 0, 0); 
     }
+    // 纹理中心处的值作为估计，纯色光源是准确的
+    virtual color average_emitted() const override {
+        return emitt->value(0.5, 0.5, pointf3(0, 0, 0));
+    }
 
     virtual void getType(material_type &m) const override {
         m = material_type::DiffuseLight;
@@ -229,7 +237,7 @@ public:
         ) const override {
         // 散射方向为随机的单位球内的随机点，保持散射方向的各向同性
         srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<uniform_pdf>();
+        srec.dir_pdf = scatter_pdf::uniform();
         srec.is_specular= false;
         srec.is_medium = true;
         srec.scatter_ray = ray(r_in);
@@ -270,7 +278,7 @@ public:
     ) const override {
         // 散射方向为随机的单位球内的随机点，保持散射方向的各向同性
         srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<uniform_pdf>();
+        srec.dir_pdf = scatter_pdf::uniform();
         return true;
     }
 
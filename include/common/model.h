@@ -1,4 +1,5 @@
 #pragma once
+#include <string>
 #include <vector>
 #include "common.h"
 class model
@@ -29,6 +30,36 @@ public:
 
 
 };
+/*  mesh_data: 索引形式的三角网格
+
+    顶点属性保存在共享的数组中，每个三角形通过3个下标引用顶点。
+    uvs和normals可以为空；uv_indices和normal_indices为空时使用indices。
+    OBJ中一部分面省略了纹理或法向量下标时，这些顶点的下标为absent_index，
+    对应的三角形使用默认的纹理坐标和几何法向量。
+*/
+constexpr int absent_index = -1;
+
+struct mesh_data {
+    std::vector<pointf3> positions;
+    std::vector<texf2> uvs;
+    std::vector<vecf3> normals;
+    std::vector<int> indices;
+    std::vector<int> uv_indices;
+    std::vector<int> normal_indices;
+
+    size_t numTriangles() const { return indices.size() / 3; }
+};
+
+/*  load_obj: 读取OBJ文件中的v、vt、vn和f，直接填入mesh
+
+    文件映射到内存后按行切分成若干块，先并行地统计每一块中各类元素的个数，
+    分配好最终的数组后再并行地解析，每一块直接写入自己的区间。
+    多边形按扇形拆成三角形；f中省略的纹理或法向量下标为absent_index。出错时返回false。
+*/
+bool load_obj(const std::string &filename, mesh_data &mesh);
+// 解析已经读入内存的OBJ文件，filename只用于输出错误信息
+bool parse_obj(const char *data, size_t size, mesh_data &mesh, const std::string &filename = "");
+
 class ModelImporter
 {
 private:
@@ -0,0 +1,147 @@
+#ifndef RENDER_SAMPLER_H
+#define RENDER_SAMPLER_H
+#include "common.h"
+#include "vec2.h"
+#include <memory>
+
+enum class sampler_type {
+    Independent = 0, // 独立的伪随机数，与之前的random_double()相同
+    Stratified = 1,  // 分层抖动采样，每个维度的层单独打乱
+    Halton = 2,      // Owen打乱的Halton序列
+    Sobol = 3,       // Owen打乱的Sobol序列，每两个维度一组(padded)
+    R2 = 4           // 加性递推的rank-1序列，像素之间用R2抖动错开，低采样数时误差呈蓝噪声分布
+};
+
+/*  sampler: 每个采样的随机数来源
+
+    start_pixel_sample(x, y, index, key) 之后按顺序取得各个维度的值：先是像素内的位置、相机的镜头和时间，
+    之后每次弹射依次是俄罗斯轮盘赌、光源的选择、光源上的位置和BRDF的方向。
+    每个维度都用(像素, 维度)的哈希单独打乱(R2只用维度的哈希，见sampler.cpp)，维度之间互不相关，所以只需要每次的取用顺序一致。
+
+    start_pixel_sample同时按key和index设置当前线程的random_double()，材质内部的随机选择(比如玻璃的反射/折射)
+    仍然使用它，渲染结果与线程数无关。
+    sampler带有当前采样的状态，每个线程(块)用clone()得到自己的一份。
+*/
+class sampler {
+public:
+    virtual ~sampler() {}
+
+    // spp: 每个像素的采样数，分层采样按它划分层数，超过时从下一轮重新分层
+    explicit sampler(int spp) : samples_per_pixel(spp > 0 ? spp : 1) {}
+
+    virtual void start_pixel_sample(int x, int y, int sample_index, uint64_t pixel_key) {
+        px = x;
+        py = y;
+        index = sample_index;
+        dim = 0;
+        pixel_hash = mix_bits(pixel_key);
+        seed_random(pixel_key, sample_index);
+    }
+    virtual double get_1d() = 0;
+    virtual pointd2 get_2d() = 0;
+    // 像素内的位置，默认与其他二维的维度相同
+    virtual pointd2 get_pixel_2d() {
+        return get_2d();
+    }
+    virtual std::unique_ptr<sampler> clone() const = 0;
+
+    // 当前采样的全部状态，包括当前线程的random_double()，子类没有额外的状态。
+    // wavefront渲染时同一个sampler交替地为许多条路径取值，每条路径在各个阶段之间保存自己的状态
+    struct state {
+        int px, py, index, dim;
+        uint64_t pixel_hash;
+        pcg32 rng;
+    };
+    void save_state(state &s) const {
+        s.px = px;
+        s.py = py;
+        s.index = index;
+        s.dim = dim;
+        s.pixel_hash = pixel_hash;
+        s.rng = thread_rng();
+    }
+    void restore_state(const state &s) {
+        px = s.px;
+        py = s.py;
+        index = s.index;
+        dim = s.dim;
+        pixel_hash = s.pixel_hash;
+        thread_rng() = s.rng;
+    }
+
+protected:
+    // 当前维度的哈希，同时把维度向后移动一位
+    uint64_t next_dimension_hash() {
+        return mix_bits(pixel_hash ^ mix_bits(0x9e3779b97f4a7c15ULL + dim++));
+    }
+    // 只由维度决定的哈希，所有像素相同，同样把维度向后移动一位
+    uint64_t next_shared_dimension_hash() {
+        return mix_bits(0x9e3779b97f4a7c15ULL + dim++);
+    }
+
+protected:
+    int samples_per_pixel;
+    int px = 0, py = 0;
+    int index = 0;
+    int dim = 0;
+    uint64_t pixel_hash = 0;
+};
+
+class independent_sampler : public sampler {
+public:
+    explicit independent_sampler(int spp) : sampler(spp) {}
+    virtual double get_1d() override {
+        return random_double();
+    }
+    virtual pointd2 get_2d() override {
+        double u = random_double();
+        return pointd2(u, random_double());
+    }
+    virtual std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<independent_sampler>(*this);
+    }
+};
+
+class stratified_sampler : public sampler {
+public:
+    explicit stratified_sampler(int spp) : sampler(spp) {}
+    virtual double get_1d() override;
+    virtual pointd2 get_2d() override;
+    virtual std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<stratified_sampler>(*this);
+    }
+};
+
+class halton_sampler : public sampler {
+public:
+    explicit halton_sampler(int spp) : sampler(spp) {}
+    virtual double get_1d() override;
+    virtual pointd2 get_2d() override;
+    virtual std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<halton_sampler>(*this);
+    }
+};
+
+class sobol_sampler : public sampler {
+public:
+    explicit sobol_sampler(int spp) : sampler(spp) {}
+    virtual double get_1d() override;
+    virtual pointd2 get_2d() override;
+    virtual std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<sobol_sampler>(*this);
+    }
+};
+
+class r2_sampler : public sampler {
+public:
+    explicit r2_sampler(int spp) : sampler(spp) {}
+    virtual double get_1d() override;
+    virtual pointd2 get_2d() override;
+    virtual std::unique_ptr<sampler> clone() const override {
+        return std::make_unique<r2_sampler>(*this);
+    }
+};
+
+std::unique_ptr<sampler> create_sampler(sampler_type type, int spp);
+
+#endif //RENDER_SAMPLER_H
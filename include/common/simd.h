@@ -0,0 +1,10 @@
+#ifndef RENDER_SIMD_H
+#define RENDER_SIMD_H
+
+// x86-64 上SSE2总是可用，不需要额外的编译选项；定义RENDER_NO_SIMD可以强制使用标量代码
+#if !defined(RENDER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define RENDER_USE_SSE
+#include <emmintrin.h>
+#endif
+
+#endif //RENDER_SIMD_H
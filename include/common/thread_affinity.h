@@ -0,0 +1,40 @@
+#ifndef RENDER_THREAD_AFFINITY_H
+#define RENDER_THREAD_AFFINITY_H
+#include <vector>
+
+/*  cpu_topology: 进程可以使用的逻辑处理器及其所在的NUMA结点
+
+    Linux下从/sys/devices/system/node读取每个结点的处理器，Windows下使用GetNumaNodeProcessorMask(只考虑第一个处理器组)，
+    其他平台或读取失败时所有处理器都当作结点0。处理器按结点排列，同一个结点的处理器是连续的。
+*/
+struct cpu_topology {
+    std::vector<int> cpus;  // 逻辑处理器的编号
+    std::vector<int> nodes; // cpus[k]所在的NUMA结点
+
+    // 第一次调用时查询，之后返回同一份结果
+    static const cpu_topology &get();
+
+    // num_workers个线程中第worker个绑定的处理器：线程均匀地分布在所有处理器上，
+    // 编号相邻的线程(分到相邻的块)落在同一个结点上。没有可用的处理器时返回-1
+    int cpu_for_worker(int worker, int num_workers) const;
+    int node_count() const;
+};
+
+/*  thread_pin: 在作用域内把当前线程绑定到一个逻辑处理器上，析构时恢复原来的亲和性
+
+    线程池中的线程会被之后的其他并行区域复用，所以渲染结束后要解除绑定。cpu < 0 或者平台不支持时什么也不做。
+*/
+class thread_pin {
+public:
+    explicit thread_pin(int cpu);
+    ~thread_pin();
+    thread_pin(const thread_pin &) = delete;
+    thread_pin &operator=(const thread_pin &) = delete;
+
+    bool pinned() const { return !saved_mask.empty(); }
+
+private:
+    std::vector<unsigned char> saved_mask; // 绑定之前的亲和性掩码，为空表示没有绑定
+};
+
+#endif //RENDER_THREAD_AFFINITY_H
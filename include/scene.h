@@ -22,6 +22,7 @@
 #include "sphere.h"
 #include "participate_medium.h"
 #include "mesh_triangle.h"
+#include "instance.h"
 
 typedef struct Scene{
     shared_ptr<texture> background;
@@ -45,6 +46,7 @@ void cornell_mitsuba(Scene &scene);
 void cornell_mesh_objects(Scene &scene);
 
 void cornell_zoom(Scene &scene);
+void cornell_instances(Scene &scene);
 void final_scene(Scene &scene);
 
 void test_scene(Scene & scene);
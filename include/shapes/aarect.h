@@ -13,12 +13,17 @@ class xy_rect : public hittable {//法向量为(0,0,1)
             : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k),mp(mat){};
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
         virtual double pdf_value(const pointf3& o, const vecf3& v) const override;
 
         virtual vecf3 random(const vecf3& o) const override;
+        virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const override;
+        virtual double area() const override {
+            return (x1 - x0) * (y1 - y0);
+        }
         virtual void getMaterial(shared_ptr<material>& mptr) const override{
             mptr = mp;
         }
@@ -35,11 +40,16 @@ class xz_rect : public hittable {//法向量为(0,1,0)
             : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat){};
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
         virtual double pdf_value(const pointf3& o, const vecf3& v) const override;
         virtual vecf3 random(const vecf3& o) const override;
+        virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const override;
+        virtual double area() const override {
+            return (x1 - x0) * (z1 - z0);
+        }
         virtual void getMaterial(shared_ptr<material>& mptr) const override{
             mptr = mp;
         }
@@ -57,12 +67,17 @@ class yz_rect : public hittable {//法向量为(1,0,0)
             : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat){};
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
         virtual double pdf_value(const pointf3& o, const vecf3& v) const override;
 
         virtual vecf3 random(const vecf3& o) const override;
+        virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const override;
+        virtual double area() const override {
+            return (y1 - y0) * (z1 - z0);
+        }
         virtual void getMaterial(shared_ptr<material>& mptr) const override{
             mptr = mp;
         }
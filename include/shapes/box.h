@@ -12,8 +12,14 @@ class box : public hittable {
     box(const pointf3& p0, const pointf3& p1, shared_ptr<material> m);
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        return sides.occluded(r, t_min, t_max);
+    }
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual double area() const override {
+        return sides.area();
+    }
     virtual void getMaterial(shared_ptr<material>& mptr) const override{
         mptr = mat_ptr;
     }
@@ -2,63 +2,625 @@
 #define BVH_H
 
 #include <algorithm>
+#include <cstdint>
 #include "common.h"
+#include "simd.h"
 #include "hittable.h"
 #include "hittable_list.h"
 #include "empty.h"
-#include <stack>
-// 按照盒子的axis轴中最小值来比较两个盒子的度量大小
-inline bool box_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b, int axis) {
-    aabb box_a;
-    aabb box_b;
-
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
-    return box_a.min().e[axis] < box_b.min().e[axis];
-}
 
-inline bool box_x_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
-    return box_compare(a, b, 0);
-}
+/*  linear_bvh_node: 建树时使用的二叉树结点，32字节，按深度优先的顺序连续存放
+
+    内部结点的左子结点紧跟在它后面，右子结点的下标为second_child_offset；
+    叶结点保存的是一段连续的物体下标 [primitives_offset, primitives_offset+n_primitives)
+*/
+struct alignas(32) linear_bvh_node {
+    aabb bounds;
+    union {
+        int primitives_offset;   // 叶结点
+        int second_child_offset; // 内部结点
+    };
+    uint16_t n_primitives;       // 0 表示内部结点
+    uint8_t axis;                // 内部结点的划分轴
+    uint8_t pad[1];
+};
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should be 32 bytes");
+
+/*  bvh4_node: 4叉BVH的结点，由二叉树合并而来，128字节
 
-inline bool box_y_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
-    return box_compare(a, b, 1);
+    4个子结点的包围盒按SoA存放，bounds[0]为最小点，bounds[1]为最大点，bounds[i][a][k]为第k个子结点第a个分量，
+    一次SIMD运算就可以与4个包围盒求交。
+    count[k] > 0 时第k个子结点是叶结点，物体下标为[child[k], child[k]+count[k])；
+    count[k] == 0 时child[k]为内部结点的下标；child[k] == -1 为空位，空位的包围盒为空集，求交时一定不相交。
+*/
+struct alignas(16) bvh4_node {
+    float bounds[2][3][4];
+    int child[4];
+    int count[4];
+};
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node should be 128 bytes");
+
+// 遍历前为每条光线预先计算的数据：方向的倒数，以及每个轴上近处的平面是最小点(0)还是最大点(1)
+struct bvh_ray {
+    float org[3];
+    float inv_dir[3];
+    int near[3];
+#ifdef RENDER_USE_SSE
+    __m128 org4[3];
+    __m128 inv_dir4[3];
+#endif
+    bvh_ray() = default;
+    explicit bvh_ray(const ray &r) {
+        for (int a = 0; a < 3; a++) {
+            org[a] = r.origin()[a];
+            inv_dir[a] = 1.0f / r.direction()[a];
+            near[a] = inv_dir[a] < 0 ? 1 : 0;
+#ifdef RENDER_USE_SSE
+            org4[a] = _mm_set1_ps(org[a]);
+            inv_dir4[a] = _mm_set1_ps(inv_dir[a]);
+#endif
+        }
+    }
+};
+
+/*  intersect_bvh4: 光线与结点的4个子包围盒求交，返回相交的掩码，t_near为光线进入每个包围盒时的t
+
+    (bounds - org) * inv_dir 为0乘以无穷时得到NaN，max/min中NaN放在第一个参数，结果取第二个参数，
+    等同于忽略这个轴。t_far 稍微放大，避免浮点误差把贴着边界的光线判为不相交。
+*/
+inline int intersect_bvh4(const bvh4_node &node, const bvh_ray &r, float t_min, float t_max, float t_near[4]) {
+    const float far_scale = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+#ifdef RENDER_USE_SSE
+    __m128 tn = _mm_set1_ps(t_min);
+    __m128 tf = _mm_set1_ps(t_max);
+    for (int a = 0; a < 3; a++) {
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[r.near[a]][a]), r.org4[a]), r.inv_dir4[a]);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[1 - r.near[a]][a]), r.org4[a]), r.inv_dir4[a]);
+        tn = _mm_max_ps(t0, tn);
+        tf = _mm_min_ps(_mm_mul_ps(t1, _mm_set1_ps(far_scale)), tf);
+    }
+    _mm_storeu_ps(t_near, tn);
+    return _mm_movemask_ps(_mm_cmplt_ps(tn, tf));
+#else
+    int mask = 0;
+    for (int k = 0; k < 4; k++) {
+        float tn = t_min, tf = t_max;
+        for (int a = 0; a < 3; a++) {
+            float t0 = (node.bounds[r.near[a]][a][k] - r.org[a]) * r.inv_dir[a];
+            float t1 = (node.bounds[1 - r.near[a]][a][k] - r.org[a]) * r.inv_dir[a] * far_scale;
+            tn = t0 > tn ? t0 : tn;
+            tf = t1 < tf ? t1 : tf;
+        }
+        t_near[k] = tn;
+        if (tn < tf)
+            mask |= 1 << k;
+    }
+    return mask;
+#endif
 }
 
-inline bool box_z_compare(const shared_ptr<hittable>& a, const shared_ptr<hittable>& b) {
-    return box_compare(a, b, 2);
+/*  bvh_packet: 一起遍历的一组光线(最多16条)，以及它们的起点和方向倒数在每个轴上的区间
+
+    光线由掩码mask选出，rays[i]对应输入的第i条光线。
+    方向在同一个卦限中(每个轴上的符号相同)时，光线进入/离开包围盒的t可以由区间乘法得到下界/上界，
+    包内任何光线都不可能相交的结点直接跳过，所有光线都一定相交的结点不需要逐条测试。
+    方向不在同一个卦限中时coherent()返回false，说明光线已经发散，逐条遍历。
+*/
+struct bvh_packet {
+    static constexpr int max_size = 16;
+    bvh_ray rays[max_size];
+    float org_lo[3], org_hi[3];
+    float inv_lo[3], inv_hi[3];
+    int near[3];
+
+    static bool coherent(const ray *r, uint32_t mask) {
+        const vecf3 d0 = r[lowest_set_bit(mask)].direction();
+        for (uint32_t m = mask; m; m &= m - 1) {
+            const vecf3 d = r[lowest_set_bit(m)].direction();
+            // 分量太小时方向的倒数为无穷，区间乘法会得到NaN
+            for (int a = 0; a < 3; a++)
+                if (!(d[a] * d0[a] > 0) || !(std::fabs(d[a]) > 1e-30f))
+                    return false;
+        }
+        return true;
+    }
+
+    bvh_packet(const ray *r, uint32_t mask) {
+        const int first = lowest_set_bit(mask);
+        rays[first] = bvh_ray(r[first]);
+        for (int a = 0; a < 3; a++) {
+            org_lo[a] = org_hi[a] = rays[first].org[a];
+            inv_lo[a] = inv_hi[a] = rays[first].inv_dir[a];
+            near[a] = rays[first].near[a];
+        }
+        for (uint32_t m = mask & (mask - 1); m; m &= m - 1) {
+            const int i = lowest_set_bit(m);
+            rays[i] = bvh_ray(r[i]);
+            for (int a = 0; a < 3; a++) {
+                org_lo[a] = std::min(org_lo[a], rays[i].org[a]);
+                org_hi[a] = std::max(org_hi[a], rays[i].org[a]);
+                inv_lo[a] = std::min(inv_lo[a], rays[i].inv_dir[a]);
+                inv_hi[a] = std::max(inv_hi[a], rays[i].inv_dir[a]);
+            }
+        }
+    }
+};
+
+/*  intersect_bvh4_interval: 包内的光线与结点的4个子包围盒做区间测试，返回可能相交的子结点的掩码
+
+    t_near为包内光线进入包围盒的t的下界。all_hit为包内所有光线都一定相交的子结点的掩码：
+    进入的t的上界不超过离开的t的下界，并且不超过t_max_lo(包内光线t_max的最小值)
+*/
+inline int intersect_bvh4_interval(const bvh4_node &node, const bvh_packet &p, float t_min, float t_max,
+                                   float t_max_lo, float t_near[4], int &all_hit) {
+    const float far_scale = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+#ifdef RENDER_USE_SSE
+    __m128 tn = _mm_set1_ps(t_min), tf = _mm_set1_ps(t_max);
+    __m128 tn_hi = tn, tf_lo = _mm_set1_ps(t_max_lo);
+    for (int a = 0; a < 3; a++) {
+        const __m128 org_lo = _mm_set1_ps(p.org_lo[a]), org_hi = _mm_set1_ps(p.org_hi[a]);
+        const __m128 inv_lo = _mm_set1_ps(p.inv_lo[a]), inv_hi = _mm_set1_ps(p.inv_hi[a]);
+        const __m128 bn = _mm_load_ps(node.bounds[p.near[a]][a]), bf = _mm_load_ps(node.bounds[1 - p.near[a]][a]);
+        const __m128 n0 = _mm_sub_ps(bn, org_hi), n1 = _mm_sub_ps(bn, org_lo);
+        const __m128 f0 = _mm_sub_ps(bf, org_hi), f1 = _mm_sub_ps(bf, org_lo);
+        const __m128 nl = _mm_mul_ps(n0, inv_lo), nh = _mm_mul_ps(n0, inv_hi);
+        const __m128 ml = _mm_mul_ps(n1, inv_lo), mh = _mm_mul_ps(n1, inv_hi);
+        const __m128 fl = _mm_mul_ps(f0, inv_lo), fh = _mm_mul_ps(f0, inv_hi);
+        const __m128 gl = _mm_mul_ps(f1, inv_lo), gh = _mm_mul_ps(f1, inv_hi);
+        tn = _mm_max_ps(tn, _mm_min_ps(_mm_min_ps(nl, nh), _mm_min_ps(ml, mh)));
+        tf = _mm_min_ps(tf, _mm_mul_ps(_mm_max_ps(_mm_max_ps(fl, fh), _mm_max_ps(gl, gh)), _mm_set1_ps(far_scale)));
+        tn_hi = _mm_max_ps(tn_hi, _mm_max_ps(_mm_max_ps(nl, nh), _mm_max_ps(ml, mh)));
+        tf_lo = _mm_min_ps(tf_lo, _mm_min_ps(_mm_min_ps(fl, fh), _mm_min_ps(gl, gh)));
+    }
+    _mm_storeu_ps(t_near, tn);
+    all_hit = _mm_movemask_ps(_mm_cmple_ps(tn_hi, tf_lo));
+    return _mm_movemask_ps(_mm_cmple_ps(tn, tf)) | all_hit;
+#else
+    int mask = 0;
+    all_hit = 0;
+    for (int k = 0; k < 4; k++) {
+        float tn = t_min, tf = t_max;
+        float tn_hi = t_min, tf_lo = t_max_lo;
+        for (int a = 0; a < 3; a++) {
+            // (b - org) * inv_dir 在区间的4个端点上取得最值
+            float n0 = node.bounds[p.near[a]][a][k] - p.org_hi[a], n1 = node.bounds[p.near[a]][a][k] - p.org_lo[a];
+            float f0 = node.bounds[1 - p.near[a]][a][k] - p.org_hi[a], f1 = node.bounds[1 - p.near[a]][a][k] - p.org_lo[a];
+            float nl = n0 * p.inv_lo[a], nh = n0 * p.inv_hi[a], ml = n1 * p.inv_lo[a], mh = n1 * p.inv_hi[a];
+            float fl = f0 * p.inv_lo[a], fh = f0 * p.inv_hi[a], gl = f1 * p.inv_lo[a], gh = f1 * p.inv_hi[a];
+            float t0 = std::min(std::min(nl, nh), std::min(ml, mh));
+            float t1 = std::max(std::max(fl, fh), std::max(gl, gh));
+            tn = t0 > tn ? t0 : tn;
+            tf = t1 * far_scale < tf ? t1 * far_scale : tf;
+            tn_hi = std::max(tn_hi, std::max(std::max(nl, nh), std::max(ml, mh)));
+            tf_lo = std::min(tf_lo, std::min(std::min(fl, fh), std::min(gl, gh)));
+        }
+        t_near[k] = tn;
+        if (tn <= tf)
+            mask |= 1 << k;
+        if (tn_hi <= tf_lo)
+            all_hit |= 1 << k;
+    }
+    return mask | all_hit;
+#endif
 }
 
-int partition(std::vector<shared_ptr<hittable>>& objects,int start,int end,const int& axis);
-int getMidNumber(std::vector<shared_ptr<hittable>> &objects, int start, int end, int pos,const int& axis);
+enum class bvh_split_method {
+    SAH,    // 分桶的表面积启发式
+    Median  // 包围盒中心跨度最大的轴上取中位数
+};
+
+struct bvh_build_options {
+    bvh_split_method split_method = bvh_split_method::SAH;
+    int max_leaf_size = 4;   // 叶结点中最多的物体数
+    int n_buckets = 12;      // SAH的分桶数
+    double traversal_cost = 0.125; // 访问一次内部结点相对于一次物体求交的代价
+    int leaf_block_size = 1; // 叶结点中的物体每次按这么多个一起求交，SAH按块数计算叶结点的代价
+    bool parallel = true;    // 用OpenMP任务并行地构建子树，结果与串行构建相同
+    int parallel_threshold = 4096; // 物体数少于该值的子树串行构建
+};
+
+/*  linear_bvh: 只依赖于物体包围盒的BVH
+
+    build() 根据每个物体的包围盒建树，建树的过程是确定的，相同的输入总是得到相同的树，order返回叶结点中物体的顺序，调用者按照这个顺序重排物体，
+    这样每个叶结点中的物体在内存中也是连续的。
+    先用SAH建二叉树，再合并成4叉树：每次展开表面积最大的内部子结点，直到有4个子结点，遍历的深度大约减半。
+    traverse() 用栈代替递归遍历，叶结点按距离从近到远求交，内部结点按距离从远到近压栈，出栈时跳过比当前交点更远的结点。
+*/
+class linear_bvh {
+public:
+    void build(const std::vector<aabb> &prim_bounds, std::vector<int> &order,
+               const bvh_build_options &options = bvh_build_options());
+
+    // 直接使用已经建好的结点，比如从缓存文件中读入的树
+    void assign(std::vector<bvh4_node> wide_nodes, const aabb &bounds) {
+        nodes = std::move(wide_nodes);
+        root_bounds = bounds;
+    }
+
+    bool empty() const { return nodes.empty(); }
+    aabb bounds() const { return root_bounds; }
+
+    /*  leaf(first, count, t_max): 与叶结点中的物体求交，找到更近的交点时更新t_max并返回true
+    */
+    template<typename LeafFn>
+    bool traverse(const ray &r, double t_min, double t_max, LeafFn &&leaf) const {
+        if (nodes.empty())
+            return false;
+        return traverse_from(0, bvh_ray(r), t_min, t_max, leaf);
+    }
+
+    /*  any_hit: 与traverse相同，但leaf(first, count)返回true时立即结束遍历并返回true，用于遮挡测试
+    */
+    template<typename LeafFn>
+    bool any_hit(const ray &r, double t_min, double t_max, LeafFn &&leaf) const {
+        if (nodes.empty())
+            return false;
+        return any_hit_from(0, bvh_ray(r), t_min, t_max, leaf);
+    }
+
+    /*  traverse_packet: 一组光线一起遍历，每条光线的结果与逐条调用traverse相同
+
+        结点先与整个包做区间测试，排除包内任何光线都不可能相交的子结点。
+        对于内部子结点，包内第一条与之相交的光线之后的所有光线都进入该子结点(first-hit)，
+        方向相近的光线(相邻像素的相机光线，指向同一个光源的阴影光线)通常只需要一两条光线与结点求交；
+        叶结点在与物体求交之前逐条光线测试包围盒，不会多调用物体的求交。
+        包内的光线发散(没有可以做区间测试的轴)时逐条遍历，子树中只剩一条光线时也改为单条光线遍历。
+        leaf(first, count, m): 掩码m中的光线与叶结点中的物体求交，找到更近的交点时更新t_max[i]，返回这些光线的掩码
+    */
+    template<typename LeafFn>
+    void traverse_packet(const ray *rays, uint32_t mask, double t_min, double *t_max, LeafFn &&leaf) const {
+        if (nodes.empty() || !mask)
+            return;
+        if (!(mask & (mask - 1))) {
+            int i = lowest_set_bit(mask);
+            traverse_from(0, bvh_ray(rays[i]), t_min, t_max[i], single_ray_leaf(i, leaf));
+            return;
+        }
+        if (!bvh_packet::coherent(rays, mask)) {
+            for (uint32_t m = mask; m; m &= m - 1) {
+                int i = lowest_set_bit(m);
+                traverse_from(0, bvh_ray(rays[i]), t_min, t_max[i], single_ray_leaf(i, leaf));
+            }
+            return;
+        }
+        const bvh_packet packet(rays, mask);
+        struct stack_entry {
+            int node;
+            uint32_t rays;
+            float t;
+        };
+        stack_entry to_visit[stack_size];
+        int to_visit_offset = 0;
+        stack_entry current = {0, mask, 0.0f};
+        while (true) {
+            const bvh4_node &node = nodes[current.node];
+            float packet_t_max = 0, packet_t_max_lo = infinity;
+            for (uint32_t m = current.rays; m; m &= m - 1) {
+                packet_t_max = std::max(packet_t_max, float(t_max[lowest_set_bit(m)]));
+                packet_t_max_lo = std::min(packet_t_max_lo, float(t_max[lowest_set_bit(m)]));
+            }
+            float child_t[4];
+            int all_hit;
+            int cull = intersect_bvh4_interval(node, packet, float(t_min), packet_t_max, packet_t_max_lo, child_t,
+                                               all_hit);
+            uint32_t child_rays[4] = {0, 0, 0, 0};
+            float t_near[bvh_packet::max_size][4];
+            int leaves = 0, inner = 0;
+            for (int k = 0; k < 4; k++) {
+                if (all_hit & (1 << k))
+                    child_rays[k] = current.rays;  // 包内所有光线都相交，不需要逐条测试
+                else if (cull & (1 << k))
+                    (node.count[k] > 0 ? leaves : inner) |= 1 << k;
+            }
+            for (uint32_t m = current.rays; m && (leaves || inner); m &= m - 1) {
+                int i = lowest_set_bit(m);
+                int mask = intersect_bvh4(node, packet.rays[i], float(t_min), float(t_max[i]), t_near[i]);
+                for (int k = 0; k < 4; k++) {
+                    if (mask & leaves & (1 << k))
+                        child_rays[k] |= 1u << i;
+                    else if (mask & inner & (1 << k))
+                        child_rays[k] = m; // 这条光线及之后的光线
+                }
+                inner &= ~mask;
+            }
+            // 相交的子结点按包内t_near的下界从小到大排序
+            int order[4], cnt = 0;
+            for (int k = 0; k < 4; k++) {
+                if (!child_rays[k])
+                    continue;
+                int j = cnt++;
+                while (j > 0 && child_t[order[j - 1]] > child_t[k]) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = k;
+            }
+            for (int j = 0; j < cnt; j++) {
+                int k = order[j];
+                if (node.count[k] == 0)
+                    continue;
+                // 逐条测试过的光线用自己的t_near，否则用包的下界
+                uint32_t leaf_rays = 0;
+                for (uint32_t m = child_rays[k]; m; m &= m - 1) {
+                    int i = lowest_set_bit(m);
+                    if (((all_hit >> k) & 1 ? child_t[k] : t_near[i][k]) <= t_max[i])
+                        leaf_rays |= 1u << i;
+                }
+                if (leaf_rays)
+                    leaf(node.child[k], node.count[k], leaf_rays);
+            }
+            for (int j = cnt - 1; j >= 0; j--) {
+                int k = order[j];
+                if (node.count[k] == 0)
+                    to_visit[to_visit_offset++] = {node.child[k], child_rays[k], child_t[k]};
+            }
+            // 出栈，跳过比包内所有光线当前的交点都远的结点，只剩一条光线的子树逐条遍历
+            while (true) {
+                if (to_visit_offset == 0)
+                    return;
+                current = to_visit[--to_visit_offset];
+                bool nearer = false;
+                for (uint32_t m = current.rays; m && !nearer; m &= m - 1)
+                    nearer = current.t <= t_max[lowest_set_bit(m)];
+                if (!nearer)
+                    continue;
+                if (current.rays & (current.rays - 1))
+                    break;
+                int i = lowest_set_bit(current.rays);
+                traverse_from(current.node, packet.rays[i], t_min, t_max[i], single_ray_leaf(i, leaf));
+            }
+        }
+    }
+
+    /*  any_hit_packet: 一组光线的遮挡测试，返回被遮挡的光线的掩码
+        leaf(first, count, m)返回掩码m中被叶结点中的物体遮挡的光线，这些光线之后不再遍历
+    */
+    template<typename LeafFn>
+    uint32_t any_hit_packet(const ray *rays, uint32_t mask, double t_min, const double *t_max, LeafFn &&leaf) const {
+        if (nodes.empty() || !mask)
+            return 0;
+        if (!(mask & (mask - 1))) {
+            int i = lowest_set_bit(mask);
+            return any_hit_from(0, bvh_ray(rays[i]), t_min, t_max[i], single_ray_any_hit_leaf(i, leaf)) ? mask : 0;
+        }
+        uint32_t done = 0; // 已经被遮挡的光线
+        if (!bvh_packet::coherent(rays, mask)) {
+            for (uint32_t m = mask; m; m &= m - 1) {
+                int i = lowest_set_bit(m);
+                if (any_hit_from(0, bvh_ray(rays[i]), t_min, t_max[i], single_ray_any_hit_leaf(i, leaf)))
+                    done |= 1u << i;
+            }
+            return done;
+        }
+        const bvh_packet packet(rays, mask);
+        float packet_t_max = 0, packet_t_max_lo = infinity;
+        for (uint32_t m = mask; m; m &= m - 1) {
+            packet_t_max = std::max(packet_t_max, float(t_max[lowest_set_bit(m)]));
+            packet_t_max_lo = std::min(packet_t_max_lo, float(t_max[lowest_set_bit(m)]));
+        }
+        struct stack_entry {
+            int node;
+            uint32_t rays;
+        };
+        stack_entry to_visit[stack_size];
+        int to_visit_offset = 0;
+        stack_entry current = {0, mask};
+        while (true) {
+            const bvh4_node &node = nodes[current.node];
+            float child_t[4];
+            int all_hit;
+            int cull = intersect_bvh4_interval(node, packet, float(t_min), packet_t_max, packet_t_max_lo, child_t,
+                                               all_hit);
+            uint32_t child_rays[4] = {0, 0, 0, 0};
+            int leaves = 0, inner = 0;
+            for (int k = 0; k < 4; k++) {
+                if (all_hit & (1 << k))
+                    child_rays[k] = current.rays;
+                else if (cull & (1 << k))
+                    (node.count[k] > 0 ? leaves : inner) |= 1 << k;
+            }
+            for (uint32_t m = current.rays; m && (leaves || inner); m &= m - 1) {
+                int i = lowest_set_bit(m);
+                float t_near[4];
+                int mask = intersect_bvh4(node, packet.rays[i], float(t_min), float(t_max[i]), t_near);
+                for (int k = 0; k < 4; k++) {
+                    if (mask & leaves & (1 << k))
+                        child_rays[k] |= 1u << i;
+                    else if (mask & inner & (1 << k))
+                        child_rays[k] = m;
+                }
+                inner &= ~mask;
+            }
+            for (int k = 0; k < 4; k++) {
+                if (!child_rays[k])
+                    continue;
+                if (node.count[k] > 0) {
+                    if (child_rays[k] & ~done)
+                        done |= leaf(node.child[k], node.count[k], child_rays[k] & ~done);
+                } else {
+                    to_visit[to_visit_offset++] = {node.child[k], child_rays[k]};
+                }
+            }
+            while (true) {
+                if (to_visit_offset == 0 || done == mask)
+                    return done;
+                current = to_visit[--to_visit_offset];
+                current.rays &= ~done;
+                if (!current.rays)
+                    continue;
+                if (current.rays & (current.rays - 1))
+                    break;
+                int i = lowest_set_bit(current.rays);
+                if (any_hit_from(current.node, packet.rays[i], t_min, t_max[i], single_ray_any_hit_leaf(i, leaf)))
+                    done |= 1u << i;
+            }
+        }
+    }
+
+public:
+    std::vector<bvh4_node> nodes;
+
+private:
+    // 二叉树最深约为64层，4叉树每层最多压栈3个结点
+    static constexpr int stack_size = 256;
+
+    // 包遍历中只剩一条光线时，把包的leaf包装为单条光线遍历使用的leaf，
+    // 传给traverse_from的t_max就是t_max[i]本身，包的leaf对它的更新直接生效
+    template<typename LeafFn>
+    static auto single_ray_leaf(int i, LeafFn &leaf) {
+        return [i, &leaf](int first, int count, double &) {
+            return leaf(first, count, 1u << i) != 0;
+        };
+    }
+    template<typename LeafFn>
+    static auto single_ray_any_hit_leaf(int i, LeafFn &leaf) {
+        return [i, &leaf](int first, int count) {
+            return leaf(first, count, 1u << i) != 0;
+        };
+    }
+
+    // 从结点root开始遍历，t_max更新为最近的交点
+    template<typename LeafFn>
+    bool traverse_from(int root, const bvh_ray &br, double t_min, double &t_max, LeafFn &&leaf) const {
+        struct stack_entry {
+            int node;
+            float t;
+        };
+        stack_entry to_visit[stack_size];
+        int to_visit_offset = 0;
+        int current = root;
+        bool hit_anything = false;
+        while (true) {
+            const bvh4_node &node = nodes[current];
+            float t_near[4];
+            int mask = intersect_bvh4(node, br, float(t_min), float(t_max), t_near);
+            // 相交的子结点按t_near从小到大排序
+            int order[4], n = 0;
+            for (int k = 0; k < 4; k++) {
+                if (!(mask & (1 << k)))
+                    continue;
+                int j = n++;
+                while (j > 0 && t_near[order[j - 1]] > t_near[k]) {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = k;
+            }
+            for (int j = 0; j < n; j++) {
+                int k = order[j];
+                if (node.count[k] > 0 && t_near[k] <= t_max && leaf(node.child[k], node.count[k], t_max))
+                    hit_anything = true;
+            }
+            for (int j = n - 1; j >= 0; j--) {
+                int k = order[j];
+                if (node.count[k] == 0 && t_near[k] <= t_max)
+                    to_visit[to_visit_offset++] = {node.child[k], t_near[k]};
+            }
+            // 出栈时跳过比当前最近交点更远的结点
+            do {
+                if (to_visit_offset == 0)
+                    return hit_anything;
+                --to_visit_offset;
+            } while (to_visit[to_visit_offset].t > t_max);
+            current = to_visit[to_visit_offset].node;
+        }
+    }
+
+    template<typename LeafFn>
+    bool any_hit_from(int root, const bvh_ray &br, double t_min, double t_max, LeafFn &&leaf) const {
+        int to_visit[stack_size];
+        int to_visit_offset = 0;
+        int current = root;
+        while (true) {
+            const bvh4_node &node = nodes[current];
+            float t_near[4];
+            int mask = intersect_bvh4(node, br, float(t_min), float(t_max), t_near);
+            for (int k = 0; k < 4; k++) {
+                if (!(mask & (1 << k)))
+                    continue;
+                if (node.count[k] > 0) {
+                    if (leaf(node.child[k], node.count[k]))
+                        return true;
+                } else {
+                    to_visit[to_visit_offset++] = node.child[k];
+                }
+            }
+            if (to_visit_offset == 0)
+                return false;
+            current = to_visit[--to_visit_offset];
+        }
+    }
+
+    struct primitive_info {
+        int index;
+        aabb bounds;
+        pointf3 centroid;
+    };
+    // 子树的结点和物体顺序写入out_nodes和out_order的末尾，结点中的下标都是相对于这两个数组的
+    int build_recursive(std::vector<primitive_info> &info, int start, int end, int depth,
+                        std::vector<linear_bvh_node> &out_nodes, std::vector<int> &out_order) const;
+    int split_median(std::vector<primitive_info> &info, int start, int end, int axis) const;
+    // 返回划分的位置，代价不如直接生成叶结点时返回-1
+    int split_sah(std::vector<primitive_info> &info, int start, int end, int axis,
+                  const aabb &bounds, const aabb &centroid_bounds) const;
+    // 把二叉树中以binary[index]为根的子树合并为4叉树，返回4叉树结点的下标
+    int collapse(const std::vector<linear_bvh_node> &binary, int index);
+
+    bvh_build_options options;
+    int task_depth = 0; // 只在树的前几层创建任务，更深的子树直接串行构建
+    aabb root_bounds;
+};
+
 class bvh_node:public hittable{
 public:
         bvh_node(){}
-        bvh_node(hittable_list&list,double time0,double time1)
-            : bvh_node(list.objects,0,list.objects.size(), time0,time1)
+        bvh_node(hittable_list&list,double time0,double time1,
+                 const bvh_build_options& options = bvh_build_options())
+            : bvh_node(list.objects,0,list.objects.size(), time0,time1,options)
         {}
-//        bvh_node(const std::vector<shared_ptr<hittable>>& src_objects,
-//                 size_t start, size_t end, double time0, double time1, shared_ptr<hittable> parent);
 
         bvh_node(std::vector<shared_ptr<hittable>>& src_objects,
                  size_t start,
                  size_t end,
                  double time0,
-                 double time1);
-
-//    bvh_node(const std::vector<shared_ptr<hittable>>& src_objects,
-//             double time0,
-//             double time1);
+                 double time1,
+                 const bvh_build_options& options = bvh_build_options());
 
         virtual bool hit(const ray&r,double t_min,double t_max,hit_record&re)const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box)const override;
+        virtual uint32_t hit_packet(const ray* r, uint32_t rays, double t_min, double* t_max, hit_record* recs,
+                                    pcg32* rngs) const override;
+        virtual uint32_t occluded_packet(const ray* r, uint32_t rays, double t_min, const double* t_max,
+                                         pcg32* rngs) const override;
 public:
-        aabb box;//当前结点的包围盒
-        shared_ptr<hittable> left;//由于指针指向的是虚拟基类，所以可以指向任何派生类
-        shared_ptr<hittable> right;
+        aabb box;//整棵树的包围盒
+        linear_bvh bvh;
+        std::vector<shared_ptr<hittable>> primitives;//按叶结点顺序重排后的物体
 };
 
 
+/*  top_level_bvh: 场景中所有物体之上的BVH，由RenderEngine在渲染开始时自动构建
+
+    没有包围盒的物体，以及包围盒包含整个场景的物体(比如半径很大的体积雾球)
+    放在单独的列表unbounded中，每条光线都逐个求交，不放进BVH以免降低树的质量。
+*/
+class top_level_bvh: public hittable{
+public:
+    top_level_bvh(){}
+    top_level_bvh(const hittable_list& world, double time0, double time1,
+                  const bvh_build_options& options = bvh_build_options());
 
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual uint32_t hit_packet(const ray* r, uint32_t rays, double t_min, double* t_max, hit_record* recs,
+                                pcg32* rngs) const override;
+    virtual uint32_t occluded_packet(const ray* r, uint32_t rays, double t_min, const double* t_max,
+                                     pcg32* rngs) const override;
+public:
+    shared_ptr<bvh_node> bvh;
+    hittable_list unbounded;
+};
 
-#endif
\ No newline at end of file
+#endif
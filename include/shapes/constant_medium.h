@@ -25,6 +25,11 @@ class constant_medium : public hittable {
         double t_min,
         double t_max,
         hit_record& rec) const override;
+    // 介质对光线的衰减需要完整地追踪，这里只要光线穿过包围盒就认为被遮挡
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        aabb box;
+        return !boundary->bounding_box(0, 1, box) || box.hit(r, t_min, t_max);
+    }
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         return boundary->bounding_box(time0, time1, output_box);
@@ -3,6 +3,7 @@
 #include "common.h"
 #include "aabb.h"
 #include "onb.h"
+#include "affine.h"
 class material;  // alert the compiler that the pointer is to a class
 class hittable;
 //hit_record:记录光线与物体的交点信息，包含交点坐标，法向量，光线参数t，是否正面朝向，交点材质
@@ -13,8 +14,9 @@ struct hit_record {
     double u,v;//纹理坐标
     bool front_face;//是否正面朝向
     double density;//体密度
-    shared_ptr<material> mat_ptr;//交点材质
-    shared_ptr<hittable> boundary_ptr= nullptr;//交点物体
+    //以下两个指针不持有对象，对象由场景中的shared_ptr持有，复制hit_record时不需要修改引用计数
+    const material* mat_ptr = nullptr;//交点材质
+    const hittable* boundary_ptr = nullptr;//交点物体
     inline void set_face_normal(const ray& r_in, const vecf3& outward_normal) {
         front_face = dot(r_in.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
@@ -33,7 +35,29 @@ class hittable {
         不考虑物体的前后遮挡关系，只考虑是否相交
     */
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+
+    /*  occluded:
+
+        只判断光线在(t_min, t_max)内是否与物体相交，找到任意一个交点就返回，不填写hit_record，
+        用于阴影光线的可见性测试
+    */
+    virtual bool occluded(const ray& r, double t_min, double t_max) const {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
+    }
     
+    /*  hit_packet / occluded_packet:
+
+        一组光线(最多16条)与物体求交，掩码rays中为1的位对应参与求交的光线r[i]，返回相交(被遮挡)的光线的掩码。
+        hit_packet找到更近的交点时更新t_max[i]和recs[i]，每条光线的结果与逐条调用hit/occluded相同。
+        rngs不为空时，第i条光线求交时(比如参与介质)使用rngs[i]作为当前线程的随机数生成器。
+        默认逐条求交，BVH和三角形网格按包遍历
+    */
+    virtual uint32_t hit_packet(const ray* r, uint32_t rays, double t_min, double* t_max, hit_record* recs,
+                                pcg32* rngs) const;
+    virtual uint32_t occluded_packet(const ray* r, uint32_t rays, double t_min, const double* t_max,
+                                     pcg32* rngs) const;
+
     //返回物体的包围盒 output_box. bool值表示是否有包围盒 比如无限大平面就没有
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
     
@@ -46,6 +70,24 @@ class hittable {
     virtual vecf3 random(const vecf3& o) const {
         return vecf3(1, 0, 0);
     }
+    /*  sample:
+
+        作为光源时，从o出发在物体表面上采样一个点，按照光线o->采样点与物体相交的方式填写rec，
+        rec.t为o到采样点的距离，返回该方向在立体角上的pdf，采样失败时返回0。
+        u为sampler给出的二维采样，决定采样点的位置。
+        默认实现忽略u，用random()和hit()求出交点，各个形状可以直接由采样点计算，不需要再求交
+    */
+    virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const {
+        vecf3 v = random(o);
+        if (v.length_squared() == 0 || !hit(ray(o, v), 0.001, infinity, rec))
+            return 0.0;
+        rec.t *= v.length();
+        return pdf_value(o, v);
+    }
+    //表面积，用于估计光源的功率，无法计算时返回0
+    virtual double area() const {
+        return 0.0;
+    }
 
     virtual void getMaterial(shared_ptr<material>& mptr) const{
         return;
@@ -53,52 +95,65 @@ class hittable {
 };
 
 
-//平移
-class translate: public hittable {
-   public:
-    translate(shared_ptr<hittable> p, const vecf3& displacement)
-        : ptr(p), offset(displacement) {}
+/*  transform: 仿射变换，to_world为物体空间到世界空间的4x3矩阵，to_object为它的逆
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    求交时光线变换到物体空间一次(方向不归一化，t在两个空间中相同)，交点和法向量再变换回世界空间，
+    法向量按 to_object^T 变换，对非均匀缩放也是正确的。包围盒在构造时计算好。
+    被包装的物体本身也是transform时，两个矩阵在构造时合并，嵌套的平移、旋转只剩下一层。
+*/
+class transform : public hittable {
+public:
+    transform(shared_ptr<hittable> p, const affine3 &object_to_world);
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        return ptr->occluded(to_object_ray(r), t_min, t_max);
+    }
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = box;
+        return has_box;
+    }
+    virtual void getMaterial(shared_ptr<material>& mptr) const override {
+        ptr->getMaterial(mptr);
+    }
+    // 作为光源时在物体空间中采样，pdf乘以立体角的雅可比行列式换算到世界空间
+    virtual double pdf_value(const pointf3& o, const vecf3& v) const override;
+    virtual vecf3 random(const vecf3& o) const override;
+    virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const override;
+    // 按|det|^(2/3)缩放，只有旋转、平移和均匀缩放时是准确的
+    virtual double area() const override {
+        return ptr->area() * pow(fabs(to_world.determinant()), 2.0 / 3.0);
+    }
+    // 外层的transform是否可以把自己的矩阵与这一层合并
+    virtual bool can_collapse() const { return true; }
 
-    virtual void getMaterial(shared_ptr<material>& mptr) const override{
-         ptr->getMaterial(mptr);
+protected:
+    ray to_object_ray(const ray& r) const {
+        return ray(to_object.point(r.origin()), to_object.vector(r.direction()), r.time());
     }
 
-   public:
+public:
     shared_ptr<hittable> ptr;
-    vecf3 offset;
+    affine3 to_world;
+    affine3 to_object;
+    aabb box;
+    bool has_box;
 };
 
-//旋转
-enum class Axis { X, Y, Z };
-
-class rotate : public hittable {
+//平移
+class translate : public transform {
 public:
-    rotate(shared_ptr<hittable> p, double angle, Axis axis);
+    translate(shared_ptr<hittable> p, const vecf3& displacement)
+        : transform(p, affine3::translation(displacement)) {}
+};
 
-    virtual bool hit(
-            const ray& r,
-            double t_min,
-            double t_max,
-            hit_record& rec) const override;
+//旋转
+enum class Axis { X, Y, Z };
 
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
-        output_box = bbox;
-        return hasbox;
-    }
-    virtual void getMaterial(shared_ptr<material>& mptr) const override {
-        ptr->getMaterial(mptr);
-    }
+class rotate : public transform {
 public:
-    shared_ptr<hittable> ptr;
-    double sin_theta;
-    double cos_theta;
-    bool hasbox;
-    aabb bbox;
-    Axis axis;
+    rotate(shared_ptr<hittable> p, double angle, Axis axis)
+        : transform(p, affine3::rotation(static_cast<int>(axis), angle)) {}
 };
 
 
@@ -113,12 +168,31 @@ class flip_face : public hittable {
         double t_max,
         hit_record& rec) const override;
 
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override {
+        return ptr->occluded(r, t_min, t_max);
+    }
+
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         return ptr->bounding_box(time0, time1, output_box);
     }
     virtual void getMaterial(shared_ptr<material>& mptr) const override{
         ptr->getMaterial(mptr);
     }
+    // 作为光源时，采样与原物体相同
+    virtual double pdf_value(const pointf3& o, const vecf3& v) const override {
+        return ptr->pdf_value(o, v);
+    }
+    virtual vecf3 random(const vecf3& o) const override {
+        return ptr->random(o);
+    }
+    virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const override {
+        double pdf = ptr->sample(o, u, rec);
+        rec.front_face = !rec.front_face;
+        return pdf;
+    }
+    virtual double area() const override {
+        return ptr->area();
+    }
    public:
     shared_ptr<hittable> ptr;
 
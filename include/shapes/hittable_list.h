@@ -19,10 +19,12 @@ class hittable_list:public hittable{
 
         //寻找与光线相交的最近的物体交点
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
         virtual double pdf_value(const vecf3 &o, const vecf3 &v) const override;
         virtual vecf3 random(const vecf3 &o) const override;
+        virtual double area() const override;
 
        public:
         // 采用共享指针指向hittable对象，这样可以避免对象的拷贝，提高效率
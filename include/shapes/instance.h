@@ -0,0 +1,38 @@
+#ifndef RENDER_INSTANCE_H
+#define RENDER_INSTANCE_H
+#include "common.h"
+#include "hittable.h"
+
+/*  instance: 场景中的一个物体实例
+
+    多个实例共享同一个底层物体(比如一个mesh_triangle及其BVH)，每个实例只保存
+    自己的变换和可选的材质，内存不随实例个数复制网格。变换与transform相同，每条光线只变换一次；
+    场景的top_level_bvh就是实例之上的顶层BVH。
+*/
+class instance : public transform {
+public:
+    // object_to_world: 物体空间到世界空间的变换；mat不为空时替换物体自己的材质
+    instance(shared_ptr<hittable> object, const affine3 &object_to_world, shared_ptr<material> mat = nullptr)
+        : transform(object, object_to_world), mat_ptr(mat) {}
+
+    virtual bool hit(const ray &r, double t_min, double t_max, hit_record &rec) const override {
+        if (!transform::hit(r, t_min, t_max, rec))
+            return false;
+        if (mat_ptr)
+            rec.mat_ptr = mat_ptr.get();
+        return true;
+    }
+    virtual void getMaterial(shared_ptr<material> &mptr) const override {
+        if (mat_ptr)
+            mptr = mat_ptr;
+        else
+            ptr->getMaterial(mptr);
+    }
+    // 替换了材质的实例不能与外层的变换合并
+    virtual bool can_collapse() const override { return !mat_ptr; }
+
+public:
+    shared_ptr<material> mat_ptr;
+};
+
+#endif //RENDER_INSTANCE_H
@@ -0,0 +1,55 @@
+#ifndef RENDER_LIGHT_SAMPLER_H
+#define RENDER_LIGHT_SAMPLER_H
+#include "common.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include <vector>
+
+// 光源上的一个采样点，由light_sampler::sample一次得到，不需要再与光源求交
+struct light_record {
+    vecf3 dir;          // 从着色点指向采样点的单位方向
+    double dist;        // 着色点到采样点的距离
+    pointf3 p;          // 采样点
+    vecf3 normal;       // 采样点处朝向着色点一侧的法向量
+    color radiance;     // 采样点沿-dir发出的辐射度
+    double pdf;         // 立体角上的pdf，已经乘以选中该光源的概率
+};
+
+/*  light_sampler: 多光源的采样
+
+    每个光源的功率估计为 面积 × 自发光亮度，用别名表(Vose)按功率选择光源，每次选择是O(1)的。
+    没有自发光或者无法计算面积的光源(比如作为采样提示加入的玻璃球)按其他光源的平均功率处理。
+
+    方向的pdf是每个光源的pdf按选中概率的加权和，只有光线穿过包围盒的光源才可能不为0，
+    所以光源按包围盒建一棵linear_bvh，计算pdf时只访问光线经过的光源，
+    不再对所有光源逐个求交。没有包围盒的光源放在数组的最后，每次都要计算。
+*/
+class light_sampler {
+public:
+    light_sampler() {}
+    explicit light_sampler(const hittable_list &light_list);
+
+    bool empty() const { return lights.empty(); }
+    size_t size() const { return lights.size(); }
+
+    // u为[0,1)中的随机数，返回按功率选中的光源下标，选中的概率写入prob；没有光源时返回-1
+    int pick(double u, double &prob) const;
+    // 按功率选择光源并在其上采样一个点，没有光源或采样失败(如采样点在光源的边缘上)时返回false
+    // u_pick用于选择光源，u决定光源上的位置，都由sampler给出
+    bool sample(const pointf3 &o, double time, double u_pick, const pointd2 &u, light_record &ls) const;
+    // 从o出发的方向v的pdf，与sample()的分布一致，各个光源直接计算，不需要求交；没有光源时为0
+    double pdf_value(const pointf3 &o, const vecf3 &v) const;
+
+private:
+    void buildAliasTable(const std::vector<double> &power);
+
+private:
+    std::vector<shared_ptr<hittable>> lights; // 按BVH叶结点的顺序排列，没有包围盒的光源在最后
+    std::vector<double> pmf;                  // 每个光源被选中的概率
+    std::vector<double> alias_prob;           // 别名表：第i格保留自己的概率，否则选alias[i]
+    std::vector<int> alias;
+    int num_bounded = 0;
+    linear_bvh bvh;
+};
+
+#endif //RENDER_LIGHT_SAMPLER_H
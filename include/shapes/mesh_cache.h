@@ -0,0 +1,18 @@
+#ifndef RENDER_MESH_CACHE_H
+#define RENDER_MESH_CACHE_H
+#include <cstdint>
+#include <string>
+#include "bvh.h"
+
+/*  .rmesh: mesh_triangle的二进制缓存
+
+    保存Init()之后的网格(居中并按叶结点重排后的顶点数组和下标)、4叉BVH和三角形块，
+    写在OBJ文件旁边，扩展名换成.rmesh。文件头中的key由OBJ文件的内容、缩放比例、
+    影响树结构的构建参数以及缓存格式的版本一起计算，任何一项改变时缓存失效，重新解析OBJ并覆盖缓存。
+    读取时把文件映射到内存，各个数组直接复制，不需要解析和建树。
+*/
+uint64_t mesh_cache_key(const char *obj_data, size_t obj_size, int scale, const bvh_build_options &options);
+
+std::string mesh_cache_path(const std::string &obj_filename);
+
+#endif //RENDER_MESH_CACHE_H
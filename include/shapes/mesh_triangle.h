@@ -9,32 +9,61 @@
 #include "hittable_list.h"
 #include "model.h"
 #include "bvh.h"
+#include "triangle_simd.h"
 #include <map>
+// 从OBJ文件读取网格时的参数
+struct mesh_load_options {
+    bool use_cache = true; // OBJ文件和参数都没有改变时使用旁边的.rmesh缓存，并在重新读取后写入缓存
+};
+
+/*  mesh_triangle: 索引形式存储的三角网格
+
+    所有三角形共享顶点、纹理坐标和法向量数组，BVH的叶结点直接引用三角形的下标，
+    不再为每个三角形创建一个triangle对象。
+    建树后三角形按叶结点的顺序重排，同一个叶结点中的三角形在下标数组中是连续的。
+    每个叶结点的三角形再打包成若干个triangle_block4，求交时一次测试4个三角形，
+    叶结点的child和count改为指向blocks中的下标和个数。
+*/
 class mesh_triangle: public hittable{
 public:
     mesh_triangle(){}
-    mesh_triangle(const std::vector<pointf3>& vertices,const std::vector<int>& faces,shared_ptr<material> m);
-    mesh_triangle(const std::string& filename, shared_ptr<material> m,int scale = 1);
+    // options: 网格BVH的构建参数，默认使用所有核心并行构建
+    mesh_triangle(const std::vector<pointf3>& vertices,const std::vector<int>& faces,shared_ptr<material> m,
+                  const bvh_build_options& options = bvh_build_options());
+    // 读取OBJ文件，load_options决定是否使用.rmesh缓存
+    mesh_triangle(const std::string& filename, shared_ptr<material> m,int scale = 1,
+                  const bvh_build_options& options = bvh_build_options(),
+                  const mesh_load_options& load_options = mesh_load_options());
+    mesh_triangle(mesh_data data, shared_ptr<material> m,
+                  const bvh_build_options& options = bvh_build_options());
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual uint32_t hit_packet(const ray* r, uint32_t rays, double t_min, double* t_max, hit_record* recs,
+                                pcg32* rngs) const override;
+    virtual uint32_t occluded_packet(const ray* r, uint32_t rays, double t_min, const double* t_max,
+                                     pcg32* rngs) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
     virtual void getMaterial(shared_ptr<material>& mptr) const override{
         mptr = mat_ptr;
     }
 private:
-    void Init(const std::vector<pointf3>& vertices,const std::vector<int>& faces,shared_ptr<material> m);
+    // 网格移动到包围盒中心为原点的位置，然后构建BVH
+    void Init(const bvh_build_options& options);
+    // 把叶结点中的三角形打包成SoA的块
+    void buildBlocks();
+    // 为三角形tri上重心坐标为(b1, b2)的交点填写hit_record
+    void fillRecord(const ray& r, int hit_tri, double hit_t, double hit_b1, double hit_b2, hit_record& rec) const;
+    // 读写.rmesh缓存，见mesh_cache.h；缓存不存在或已失效时loadCache返回false
+    bool loadCache(const std::string& path, uint64_t key);
+    bool saveCache(const std::string& path, uint64_t key) const;
 public:
     size_t num;
     pointf3 aabb_min;
     pointf3 aabb_max;
-    hittable_list triangles;
-    shared_ptr<bvh_node> bvh;
-//    std::vector<pointf3> vertices;
-//    std::vector<texf2> texCoords;
-//    std::vector<vecf3> normals;
-//    std::vector<int> vertInds;
-//    std::vector<int> stInds;
-//    std::vector<int> normInds;
+    mesh_data mesh;
+    linear_bvh bvh;
+    std::vector<triangle_block4> blocks;
     shared_ptr<material> mat_ptr;
 };
 
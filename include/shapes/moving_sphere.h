@@ -15,6 +15,7 @@ class moving_sphere: public hittable {
 
         virtual bool hit(
             const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
         virtual bool bounding_box(double _time0, double _time1, aabb& output_box) const override;
 
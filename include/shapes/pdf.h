@@ -83,6 +83,40 @@ inline vecf3 random_cosine_direction() {
     float y = sin(phi) * sqrt(r2);
     return vecf3(x, y, z);
 }
+// 以下几个函数的u为sampler给出的[0,1)^2中的点，不带u的版本使用random_double()
+inline vecf3 random_cosine_direction(const pointd2 &u) {
+    auto z = sqrt(1 - u.y());
+    auto phi = 2 * pi * u.x();
+    return vecf3(cos(phi) * sqrt(u.y()), sin(phi) * sqrt(u.y()), z);
+}
+inline vecf3 uniform_on_unit_sphere(const pointd2 &u) {
+    auto z = 1 - 2 * u.x();
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u.y();
+    return vecf3(r * cos(phi), r * sin(phi), z);
+}
+// 同心圆映射，保持分层的结构
+inline vecf3 uniform_in_unit_disk(const pointd2 &u) {
+    auto a = 2 * u.x() - 1, b = 2 * u.y() - 1;
+    if (a == 0 && b == 0)
+        return vecf3(0, 0, 0);
+    double r, theta;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        theta = pi / 4 * (b / a);
+    } else {
+        r = b;
+        theta = pi / 2 - pi / 4 * (a / b);
+    }
+    return vecf3(r * cos(theta), r * sin(theta), 0);
+}
+inline vecf3 random_to_sphere(double radius, double distance_squared, const pointd2 &u) {
+    auto z = 1 + u.y() * (sqrt(1 - radius * radius / distance_squared) - 1);
+    auto phi = 2 * pi * u.x();
+    auto x = cos(phi) * sqrt(1 - z * z);
+    auto y = sin(phi) * sqrt(1 - z * z);
+    return vecf3(x, y, z);
+}
 inline vecf3 random_to_sphere(double radius, double distance_squared) {
     auto r1 = random_double();
     auto r2 = random_double();
@@ -104,87 +138,72 @@ public:
     //返回采样光线方向
     virtual vecf3 generate() const = 0;
 };
-class cosin_pdf : public pdf {
-public:
-    cosin_pdf(const vecf3 &w) {
-        uvw.build_from_w(w);
-    }
 
-    virtual double value(const vecf3 &direction) const override {
-        auto cosine = dot(uvw.w(),unit_vector(direction));
-        return (cosine <= 0) ? 0 : cosine / pi;
-    }
+/*  scatter_pdf: 材质散射方向的分布
 
-    virtual vecf3 generate() const override {
-        return uvw.local(random_cosine_direction());
-    }
-    public:
-        onb uvw;
-};
-class uniform_pdf:public pdf{
+    按值保存在scatter_record中，用类型标记代替虚函数和堆上分配的对象，
+    每次散射不再需要make_shared
+*/
+class scatter_pdf : public pdf {
 public:
-    uniform_pdf(){}
-    virtual double value(const vecf3 &direction) const override {
-        return 1/(4*pi);
-    }
-    virtual vecf3 generate() const override {
-        return random_on_unit_sphere();
-    }
-};
-
-class hittable_pdf : public pdf {
-public:
-    hittable_pdf(shared_ptr<hittable> p, const pointf3 &origin) : ptr(p), o(origin) {
-    }
-    //输入光线起点o和方向v，计算与物体相交点的pdf值
-    virtual double value(const vecf3 &direction) const override {
-        return ptr->pdf_value(o, direction);
+    enum class kind {
+        None,    // 镜面反射等没有分布的情况
+        Cosine,  // 余弦分布
+        Uniform  // 球面上的均匀分布
+    };
+    scatter_pdf() {}
+
+    static scatter_pdf cosine(const vecf3 &w) {
+        scatter_pdf p;
+        p.type = kind::Cosine;
+        p.uvw.build_from_w(w);
+        return p;
     }
-    //输入光线起点o，返回从物体表面采样的点与光线起点连接的出射方向
-    virtual vecf3 generate() const override {
-        return ptr->random(o);
+    static scatter_pdf uniform() {
+        scatter_pdf p;
+        p.type = kind::Uniform;
+        return p;
     }
 
-public:
-    shared_ptr<hittable> ptr;
-    pointf3 o; // 光线起点
-};
+    bool empty() const { return type == kind::None; }
 
-class light_pdf : public pdf {
-public:
-    light_pdf(shared_ptr<hittable> p, const pointf3 &origin) : light_ptr(p), o(origin) {
-    }
-    //输入光线起点o和方向v，计算与物体相交点的pdf值
     virtual double value(const vecf3 &direction) const override {
-        return light_ptr->pdf_value(o, direction);
+        switch (type) {
+            case kind::Cosine: {
+                auto cosine = dot(uvw.w(), unit_vector(direction));
+                return (cosine <= 0) ? 0 : cosine / pi;
+            }
+            case kind::Uniform:
+                return 1 / (4 * pi);
+            default:
+                return 0;
+        }
     }
-    //输入光线起点o，返回从物体表面采样的点与光线起点连接的出射方向
-    virtual vecf3 generate() const override {
-        return light_ptr->random(o);
-    }
-public:
-    shared_ptr<hittable> light_ptr;
-    pointf3 o; // 光线起点
-};
-
 
-class mixture_pdf : public pdf {
-public:
-    mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
-        p[0] = p0;
-        p[1] = p1;
-    }
-    virtual double value(const vecf3 &direction) const override {
-        return 0.5 * p[0]->value(direction) + 0.5 * p[1]->value(direction);
-    }
     virtual vecf3 generate() const override {
-        if (random_double() < 0.5)
-            return p[0]->generate();
-        else
-            return p[1]->generate();
+        switch (type) {
+            case kind::Cosine:
+                return uvw.local(random_cosine_direction());
+            case kind::Uniform:
+                return random_on_unit_sphere();
+            default:
+                return vecf3(1, 0, 0);
+        }
+    }
+    // 由sampler给出的二维采样生成方向
+    vecf3 generate(const pointd2 &u) const {
+        switch (type) {
+            case kind::Cosine:
+                return uvw.local(random_cosine_direction(u));
+            case kind::Uniform:
+                return uniform_on_unit_sphere(u);
+            default:
+                return vecf3(1, 0, 0);
+        }
     }
 public:
-    shared_ptr<pdf> p[2];
+    kind type = kind::None;
+    onb uvw;
 };
 
 
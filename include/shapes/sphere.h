@@ -11,11 +11,17 @@ class sphere : public hittable {
             : center(cen), radius(r),mat_ptr(m){};
 
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        virtual bool occluded(const ray& r, double t_min, double t_max) const override;
         virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
         virtual double pdf_value(const pointf3& o, const vecf3& v) const override;
         //按立体角均匀采样
         virtual vecf3 random(const vecf3& o) const override;
+        //在球所张的圆锥内按立体角均匀采样方向，交点由hit()求出
+        virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const override;
+        virtual double area() const override {
+            return 4 * pi * radius * radius;
+        }
 
         virtual void getMaterial(shared_ptr<material>& mptr) const override{
             mptr = mat_ptr;
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "hittable.h"
+#include <vector>
 
 class triangle : public hittable {
 public:
@@ -15,12 +16,25 @@ public:
              const std::vector<vecf3>& normals,
              shared_ptr<material> m);
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    //作为光源时按面积均匀采样
+    virtual double pdf_value(const pointf3& o, const vecf3& v) const override;
+    virtual vecf3 random(const vecf3& o) const override;
+    virtual double sample(const pointf3& o, const pointd2& u, hit_record& rec) const override;
+    virtual double area() const override {
+        return 0.5 * cross(v1 - v0, v2 - v0).length();
+    }
+
     virtual void getMaterial(shared_ptr<material>& mptr) const override{
         mptr = mat_ptr;
     }
 private:
+    // Möller-Trumbore求交，只返回t和重心坐标
+    bool intersect(const ray& r, double t_min, double t_max, double& t, double& u, double& v) const;
+    // 由u按面积均匀地映射到三角形上的一个点，b1、b2为v1、v2的重心坐标
+    pointf3 sample_point(const pointd2& u, double& b1, double& b2) const;
     //获取三角形的纹理坐标
     void get_triangle_uv(const vecf3& p, double& u, double& v) const {
         // p: weight of three vertex
@@ -0,0 +1,114 @@
+#ifndef RENDER_TRIANGLE_SIMD_H
+#define RENDER_TRIANGLE_SIMD_H
+#include "common.h"
+#include "simd.h"
+
+/*  triangle_block4: 4个三角形按SoA的方式存放，预先计算好 v0, e1 = v1-v0, e2 = v2-v0
+
+    v0[a][k] 为第k个三角形v0的第a个分量，e1、e2同理；ids为三角形在网格中的下标，
+    不足4个时空位的ids为-1，e1、e2为0，求交时一定不相交。
+*/
+struct alignas(16) triangle_block4 {
+    float v0[3][4];
+    float e1[3][4];
+    float e2[3][4];
+    int ids[4];
+};
+
+// 一条光线在求交前预先广播好的数据，整个遍历过程中只需要计算一次
+struct block_ray {
+    float o[3];
+    float d[3];
+#ifdef RENDER_USE_SSE
+    __m128 o4[3];
+    __m128 d4[3];
+#endif
+    block_ray() = default;
+    explicit block_ray(const ray &r) {
+        for (int a = 0; a < 3; a++) {
+            o[a] = r.origin()[a];
+            d[a] = r.direction()[a];
+#ifdef RENDER_USE_SSE
+            o4[a] = _mm_set1_ps(o[a]);
+            d4[a] = _mm_set1_ps(d[a]);
+#endif
+        }
+    }
+};
+
+/*  intersect_block4: Möller-Trumbore 算法同时与4个三角形求交
+
+    返回相交的三角形的掩码(第k位对应第k个三角形)，t、b1、b2为每个三角形的交点参数和重心坐标
+*/
+inline int intersect_block4(const triangle_block4 &blk, const block_ray &r, float t_min, float t_max,
+                            float t[4], float b1[4], float b2[4]) {
+#ifdef RENDER_USE_SSE
+    const __m128 e1x = _mm_load_ps(blk.e1[0]), e1y = _mm_load_ps(blk.e1[1]), e1z = _mm_load_ps(blk.e1[2]);
+    const __m128 e2x = _mm_load_ps(blk.e2[0]), e2y = _mm_load_ps(blk.e2[1]), e2z = _mm_load_ps(blk.e2[2]);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+
+    // h = d x e2, a = e1 . h
+    __m128 hx = _mm_sub_ps(_mm_mul_ps(r.d4[1], e2z), _mm_mul_ps(r.d4[2], e2y));
+    __m128 hy = _mm_sub_ps(_mm_mul_ps(r.d4[2], e2x), _mm_mul_ps(r.d4[0], e2z));
+    __m128 hz = _mm_sub_ps(_mm_mul_ps(r.d4[0], e2y), _mm_mul_ps(r.d4[1], e2x));
+    __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)), _mm_mul_ps(e1z, hz));
+    __m128 mask = _mm_cmpneq_ps(a, zero);
+    __m128 f = _mm_div_ps(one, a);
+
+    // s = o - v0, u = f * (s . h)
+    __m128 sx = _mm_sub_ps(r.o4[0], _mm_load_ps(blk.v0[0]));
+    __m128 sy = _mm_sub_ps(r.o4[1], _mm_load_ps(blk.v0[1]));
+    __m128 sz = _mm_sub_ps(r.o4[2], _mm_load_ps(blk.v0[2]));
+    __m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+
+    // q = s x e1, v = f * (d . q)
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+    __m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(r.d4[0], qx), _mm_mul_ps(r.d4[1], qy)),
+                                        _mm_mul_ps(r.d4[2], qz)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+
+    // t = f * (e2 . q)
+    __m128 tt = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)));
+    mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(tt, _mm_set1_ps(t_min)), _mm_cmple_ps(tt, _mm_set1_ps(t_max))));
+
+    int bits = _mm_movemask_ps(mask);
+    if (bits) {
+        _mm_storeu_ps(t, tt);
+        _mm_storeu_ps(b1, u);
+        _mm_storeu_ps(b2, v);
+    }
+    return bits;
+#else
+    int bits = 0;
+    for (int k = 0; k < 4; k++) {
+        float e1[3] = {blk.e1[0][k], blk.e1[1][k], blk.e1[2][k]};
+        float e2[3] = {blk.e2[0][k], blk.e2[1][k], blk.e2[2][k]};
+        float h[3] = {r.d[1] * e2[2] - r.d[2] * e2[1], r.d[2] * e2[0] - r.d[0] * e2[2], r.d[0] * e2[1] - r.d[1] * e2[0]};
+        float a = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+        if (a == 0)
+            continue;
+        float f = 1.0f / a;
+        float s[3] = {r.o[0] - blk.v0[0][k], r.o[1] - blk.v0[1][k], r.o[2] - blk.v0[2][k]};
+        float u = f * (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]);
+        if (u < 0 || u > 1)
+            continue;
+        float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+        float v = f * (r.d[0] * q[0] + r.d[1] * q[1] + r.d[2] * q[2]);
+        if (v < 0 || u + v > 1)
+            continue;
+        float tt = f * (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]);
+        if (tt < t_min || tt > t_max)
+            continue;
+        t[k] = tt;
+        b1[k] = u;
+        b2[k] = v;
+        bits |= 1 << k;
+    }
+    return bits;
+#endif
+}
+
+#endif //RENDER_TRIANGLE_SIMD_H
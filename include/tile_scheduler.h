@@ -0,0 +1,62 @@
+#ifndef RENDER_TILE_SCHEDULER_H
+#define RENDER_TILE_SCHEDULER_H
+#include <atomic>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// 屏幕上的一个矩形块: [x0,x1) x [y0,y1)
+struct Tile {
+    int index = 0;
+    int x0 = 0, y0 = 0;
+    int x1 = 0, y1 = 0;
+    int worker = -1;      // 实际渲染该块的线程
+    double time_ms = 0.0; // 渲染该块所用时间
+};
+
+/*  TileScheduler: 基于工作窃取的分块调度器
+
+    图像被切分为 tile_size x tile_size 的块，按扫描顺序连续地分给各个线程的双端队列，
+    这样相邻的块落在同一个线程上，BVH和材质的工作集可以留在该核心的缓存中。
+    线程从自己队列的前端取块；自己的队列空了之后，从其他线程队列的后端窃取，
+    从而平衡天空、玻璃等开销差别很大的区域。
+*/
+class TileScheduler {
+public:
+    TileScheduler() = default;
+
+    void init(int width, int height, int tile_size, int num_workers);
+
+    // 为线程worker取下一个块，没有剩余的块时返回false
+    bool next(int worker, Tile &tile);
+
+    // 记录块的渲染时间，返回已完成的块数
+    int finish(const Tile &tile, double time_ms);
+
+    int tileCount() const { return static_cast<int>(tiles.size()); }
+    int stealCount() const { return steals.load(); }
+    const std::vector<Tile> &getTiles() const { return tiles; }
+
+    // 输出每个块耗时的统计信息
+    void reportTiming(std::ostream &out) const {
+        reportTiming(out, tiles, steals.load());
+    }
+    static void reportTiming(std::ostream &out, const std::vector<Tile> &tiles, int steals = -1);
+
+private:
+    struct WorkQueue {
+        std::mutex lock;
+        std::deque<int> tiles;
+    };
+    bool popLocal(int worker, int &index);
+    bool steal(int worker, int &index);
+
+    std::vector<Tile> tiles;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::atomic<int> finished{0};
+    std::atomic<int> steals{0};
+};
+
+#endif //RENDER_TILE_SCHEDULER_H
@@ -0,0 +1,81 @@
+#ifndef RENDER_WAVEFRONT_H
+#define RENDER_WAVEFRONT_H
+#include <vector>
+#include "light_sampler.h"
+#include "material.h"
+#include "sampler.h"
+
+/*  PathBatch: wavefront渲染中一批路径的状态
+
+    逐条路径渲染时，每个线程交替地求交、调用各种材质和追踪阴影光线，代码和数据的工作集都很大。
+    wavefront把一批路径的同一个阶段放在一起执行：生成相机光线 -> 求交 -> 按材质排序 -> 着色 -> 阴影光线 -> 累加，
+    每个阶段是对数组的一个紧凑循环。光线、通量和辐射度按分量分别存放(SoA)，每个阶段只读写它用到的数组；
+    着色前按材质类型排序，同一种材质的路径连续地执行，虚函数调用的目标和分支都是一致的。
+
+    active是仍在继续的路径的下标，每次弹射后压缩；着色阶段产生的阴影光线先放入队列，之后一起做遮挡测试。
+    每条路径保存自己的sampler状态，得到的随机数与逐条路径渲染完全相同。
+*/
+struct PathBatch {
+    void resize(int n);
+    int size() const {
+        return static_cast<int>(beta_r.size());
+    }
+
+    ray getRay(int i) const {
+        return ray(pointf3(org_x[i], org_y[i], org_z[i]), vecf3(dir_x[i], dir_y[i], dir_z[i]), time[i]);
+    }
+    void setRay(int i, const ray &r) {
+        org_x[i] = r.orig.x(), org_y[i] = r.orig.y(), org_z[i] = r.orig.z();
+        dir_x[i] = r.dir.x(), dir_y[i] = r.dir.y(), dir_z[i] = r.dir.z();
+        time[i] = r.tm;
+    }
+    color getBeta(int i) const {
+        return color(beta_r[i], beta_g[i], beta_b[i]);
+    }
+    void setBeta(int i, const color &b) {
+        beta_r[i] = b.x(), beta_g[i] = b.y(), beta_b[i] = b.z();
+    }
+    color getL(int i) const {
+        return color(L_r[i], L_g[i], L_b[i]);
+    }
+    void addL(int i, const color &c) {
+        L_r[i] += c.x(), L_g[i] += c.y(), L_b[i] += c.z();
+    }
+
+    // 按交点的材质类型对active做计数排序，结果写入sorted
+    void sortByMaterial();
+
+    // 着色阶段产生的阴影光线，起点是路径当前的交点
+    void pushShadow(int path, const vecf3 &dir, const light_record &ls, const color &factor,
+                    double p_RR, double weight);
+    void clearShadow();
+    int shadowCount() const {
+        return static_cast<int>(shadow_path.size());
+    }
+
+    // 光线
+    std::vector<float> org_x, org_y, org_z;
+    std::vector<float> dir_x, dir_y, dir_z;
+    std::vector<double> time;
+    // 路径通量、累计的辐射度、下一个顶点自发光的MIS权重、非镜面弹射次数
+    std::vector<float> beta_r, beta_g, beta_b;
+    std::vector<float> L_r, L_g, L_b;
+    std::vector<double> emitted_weight;
+    std::vector<int> depth;
+    std::vector<sampler::state> rng;
+    std::vector<hit_record> rec;
+    std::vector<int> material_key;
+
+    std::vector<int> active;  // 仍在继续的路径
+    std::vector<int> sorted;  // 按材质排序后的active
+
+    // 阴影光线队列：贡献为 factor * trace_shadow(...) / pdf / p_RR
+    std::vector<int> shadow_path;
+    std::vector<float> shadow_dir_x, shadow_dir_y, shadow_dir_z;
+    std::vector<double> shadow_dist;
+    std::vector<float> shadow_radiance_r, shadow_radiance_g, shadow_radiance_b;
+    std::vector<float> factor_r, factor_g, factor_b;
+    std::vector<double> shadow_pdf, shadow_p_RR, shadow_weight;
+};
+
+#endif //RENDER_WAVEFRONT_H
@@ -2,6 +2,7 @@
 // Created by Runze on 30/06/2023.
 //
 #include "mainwindow.h"
+#include <cstring>
 //#include "RayTracer.h"
 MainWindow::~MainWindow() {
 }
@@ -28,10 +29,12 @@ MainWindow::MainWindow(QWidget *parent)
     resize(1200, 800); // 修改初始窗口大小
     setMinimumSize(300, 200);
     useOpenMP = true; // 默认使用 OpenMP
+    useProgressive = false;
     renderingInProgress = false; // 默认渲染未开始
     // 连接信号和槽
     connect(this, SIGNAL(renderTimeUpdated(qint64)), this, SLOT(updateRenderTime(qint64)), Qt::QueuedConnection);
     connect(this, SIGNAL(progressUpdated(int)), this, SLOT(handleProgressUpdate(int)), Qt::QueuedConnection);
+    connect(this, SIGNAL(snapshotReady(QImage, int)), this, SLOT(handleSnapshot(QImage, int)), Qt::QueuedConnection);
 }
 
 void MainWindow::createRendererUI(QVBoxLayout *leftLayout) {
@@ -46,6 +49,7 @@ void MainWindow::createRendererUI(QVBoxLayout *leftLayout) {
     sceneComboBox->addItem("Smoke");
     sceneComboBox->addItem("Mitsuba");
     sceneComboBox->addItem("Zoom");
+    sceneComboBox->addItem("Instances");
     sceneLayout->addWidget(sceneLabel);
     sceneLayout->addWidget(sceneComboBox);
 
@@ -104,13 +108,30 @@ void MainWindow::createRendererUI(QVBoxLayout *leftLayout) {
     openMPCheckbox->setChecked(true); // 添加这一行，设置复选框默认选中
     connect(openMPCheckbox, &QCheckBox::toggled, this, &MainWindow::toggleOpenMP);
 
+    // 渐进式渲染：每一遍结束后刷新图像，可以暂停/继续
+    auto *progressiveCheckbox = new QCheckBox("Progressive", this);
+    progressiveCheckbox->setChecked(false);
+    connect(progressiveCheckbox, &QCheckBox::toggled, this, &MainWindow::toggleProgressive);
+
+    pauseButton = new QPushButton("Pause", this);
+    pauseButton->setEnabled(false);
+    connect(pauseButton, &QPushButton::clicked, this, &MainWindow::togglePause);
+
+    // 渐进式渲染的结果足够好时提前结束
+    stopButton = new QPushButton("Stop", this);
+    stopButton->setEnabled(false);
+    connect(stopButton, &QPushButton::clicked, this, &MainWindow::stopRendering);
+
     // 将所有的布局添加到 leftLayout 中
     leftLayout->addLayout(sceneLayout);
     leftLayout->addLayout(methodLayout);
     leftLayout->addLayout(samplesLayout);
     leftLayout->addWidget(openMPCheckbox);
+    leftLayout->addWidget(progressiveCheckbox);
     leftLayout->addWidget(progressBar);
     leftLayout->addWidget(renderButton);
+    leftLayout->addWidget(pauseButton);
+    leftLayout->addWidget(stopButton);
     leftLayout->addWidget(outputTextEdit);
     leftLayout->addWidget(clearOutputButton);
 }
@@ -124,6 +145,9 @@ void MainWindow::startRendering() {
     }
     renderingInProgress = true;
     renderButton->setEnabled(false);
+    pauseButton->setEnabled(useProgressive);
+    pauseButton->setText("Pause");
+    stopButton->setEnabled(useProgressive);
 
 
     int sceneChoice = sceneComboBox->currentIndex();
@@ -190,6 +214,8 @@ void MainWindow::startRendering() {
     auto *watcher = new QFutureWatcher<void>();
     connect(watcher, &QFutureWatcher<void>::finished, this, [this]() {
         renderButton->setEnabled(true);
+        pauseButton->setEnabled(false);
+        stopButton->setEnabled(false);
         renderingInProgress = false;
     });
     watcher->setFuture(future);
@@ -219,6 +245,9 @@ void MainWindow::renderInBackground(const std::string &filename) {
         case 5:
             cornell_zoom(scene);
             break;
+        case 6:
+            cornell_instances(scene);
+            break;
         default:
             cornell_box(scene);
             break;
@@ -258,7 +287,21 @@ void MainWindow::renderInBackground(const std::string &filename) {
     timer.start();
 
     //渲染
-    myRender.render(samples, sm, filename, useOpenMP);
+    if (useProgressive) {
+        // 回调在渲染线程中、两遍之间调用，此时累加缓冲区不会被修改，直接转换为图像交给GUI线程
+        myRender.setSnapshotCallback([this](const std::vector<color> &accum, int spp) {
+            int w = myRender.width, h = myRender.height;
+            std::vector<unsigned char> rgb(w * h * 3);
+            to_rgb8(w, h, accum, [spp](int) { return spp; }, rgb.data());
+            QImage image(w, h, QImage::Format_RGB888);
+            for (int y = 0; y < h; y++)
+                std::memcpy(image.scanLine(y), &rgb[y * w * 3], w * 3);
+            emit snapshotReady(image, spp);
+        });
+        myRender.renderProgressive(4, samples, sm, filename, useOpenMP);
+    } else {
+        myRender.render(samples, sm, filename, useOpenMP);
+    }
 
     // 停止计时并获取所用时间
     qint64 elapsedTime = timer.elapsed();
@@ -289,6 +332,36 @@ void MainWindow::toggleOpenMP(bool checked) {
     useOpenMP = checked;
 }
 
+void MainWindow::toggleProgressive(bool checked) {
+    useProgressive = checked;
+}
+
+void MainWindow::togglePause() {
+    if (myRender.isPaused()) {
+        myRender.resume();
+        pauseButton->setText("Pause");
+    } else {
+        myRender.pause();
+        pauseButton->setText("Resume");
+    }
+}
+
+void MainWindow::stopRendering() {
+    // stop()同时解除暂停，当前这一遍完成后renderProgressive返回
+    myRender.stop();
+    pauseButton->setEnabled(false);
+    pauseButton->setText("Pause");
+    stopButton->setEnabled(false);
+    outputTextEdit->append("Stopping after the current pass...");
+}
+
+void MainWindow::handleSnapshot(const QImage &image, int spp) {
+    // 每一遍结束后显示累加的结果
+    originalPixmap = QPixmap::fromImage(image);
+    updateImageLabel();
+    outputTextEdit->append(QString("%1 samples per pixel accumulated.").arg(spp));
+}
+
 void MainWindow::updateRenderTime(qint64 elapsedTime) {
     // 将毫秒转换为分钟和秒
     int seconds = static_cast<int>(elapsedTime / 1000); // 转换为整数秒
@@ -16,6 +16,7 @@
 #include <QLabel>
 #include <QScrollArea>
 #include <QPixmap>
+#include <QImage>
 #include <QResizeEvent>
 #include <QFrame>
 #include <QCheckBox>
@@ -51,6 +52,14 @@ private slots:
 
     void toggleOpenMP(bool checked);
 
+    void toggleProgressive(bool checked);
+
+    void togglePause();
+
+    void stopRendering();
+
+    void handleSnapshot(const QImage &image, int spp);
+
     void updateRenderTime(qint64 elapsedTime);
 
     void handleProgressUpdate(int progress);
@@ -58,6 +67,7 @@ private slots:
 signals:
     void renderTimeUpdated(qint64 elapsedTime);
     void progressUpdated(int progress);
+    void snapshotReady(const QImage &image, int spp);
 
 private:
     QVBoxLayout *mainLayout;
@@ -73,12 +83,15 @@ private:
     QComboBox *methodComboBox;
     QPushButton *renderButton;
     QPushButton *clearOutputButton;
+    QPushButton *pauseButton;
+    QPushButton *stopButton;
     QProgressBar *progressBar;
     QTextEdit *outputTextEdit;
     QLabel *imageLabel;
     QPixmap originalPixmap;
 private:
     bool useOpenMP;
+    bool useProgressive;
     bool renderingInProgress;
     RenderEngine myRender;
 };
@@ -1,74 +1,217 @@
 #include "RenderEngine.h"
 
-color RenderEngine::computePixelColor(int i, int j, int spp, SampleMethod method) const {
-    double u, v;
-    ray r;
+color RenderEngine::computeSample(int i, int j, int s, SampleMethod method, sampler &smp) const {
+    uint64_t pixel_key = static_cast<uint64_t>(j) * width + i + seed * 0x9e3779b97f4a7c15ULL;
+    smp.start_pixel_sample(i, j, s, pixel_key);
+    pointd2 pixel = smp.get_pixel_2d();
+    double u = (i + pixel.x()) / (width - 1);
+    double v = (j + pixel.y()) / (height - 1);
+    pointd2 lens = smp.get_2d();
+    ray r = scene.cam->get_ray(u, v, lens, smp.get_1d());
+    return ray_color(r, method, smp);
+}
+
+color RenderEngine::computePixelColor(int i, int j, int spp, SampleMethod method, sampler &smp,
+                                      int first_sample) const {
     color pixel_color(0, 0, 0);
-    for (int s = 0; s < spp; s += 1) {
-        u = (i + random_double()) / (width - 1);
-        v = (j + random_double()) / (height - 1);
-        r = scene.cam->get_ray(u, v);
-        pixel_color += ray_color(r, method);
+    for (int s = first_sample; s < first_sample + spp; s += 1) {
+        pixel_color += computeSample(i, j, s, method, smp);
     }
     return pixel_color;
 }
 
-void RenderEngine::render(int spp, SampleMethod method, const std::string &img_name, bool isOpenMP) {
-    using namespace std::chrono;
-    omp_set_num_threads(NUM_THREADS);
+int RenderEngine::computePixelColorAdaptive(int i, int j, int max_spp, SampleMethod method, sampler &smp,
+                                             color &pixel_color) const {
+    // Welford 算法在线计算亮度的均值和方差
+    double mean = 0, m2 = 0;
+    int n = 0;
+    int min_spp = std::min(std::max(adaptive.min_spp, 2), max_spp);
+    int batch = std::max(adaptive.batch_spp, 1);
+    while (n < max_spp) {
+        int end = n == 0 ? min_spp : std::min(n + batch, max_spp);
+        for (; n < end; n++) {
+            color sample = computeSample(i, j, n, method, smp);
+            pixel_color += sample;
+            double lum = luminance(sample);
+            double delta = lum - mean;
+            mean += delta / (n + 1);
+            m2 += delta * (lum - mean);
+        }
+        // 均值的标准误差相对于均值的大小，暗处加一个小量避免除零
+        double standard_error = sqrt(m2 / (n - 1) / n);
+        if (standard_error <= adaptive.threshold * (mean + 1e-2))
+            break;
+    }
+    return n;
+}
 
-    auto start = high_resolution_clock::now();
-    std::cout << "Rendering..." << std::endl;
-    std::vector<color> img(width * height, color(0, 0, 0));
+void RenderEngine::renderTile(const Tile &tile, int spp, int first_sample, SampleMethod method,
+                              WorkerScratch &scratch, std::vector<color> &img, std::vector<int> *counts) const {
+    int tile_w = tile.x1 - tile.x0;
+    scratch.tile_color.assign(tile_w * (tile.y1 - tile.y0), color(0, 0, 0));
+    if (wavefront && !counts && (method == SampleMethod::NEE || method == SampleMethod::MIS)) {
+        renderTileWavefront(tile, spp, first_sample, method, scratch);
+    } else {
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                color &pixel_color = scratch.tile_color[(j - tile.y0) * tile_w + (i - tile.x0)];
+                if (counts)
+                    (*counts)[j * width + i] = computePixelColorAdaptive(i, j, spp, method, *scratch.smp, pixel_color);
+                else
+                    pixel_color = computePixelColor(i, j, spp, method, *scratch.smp, first_sample);
+            }
+        }
+    }
+    // 图像只在块完成时写一次
+    for (int j = tile.y0; j < tile.y1; j++)
+        for (int i = tile.x0; i < tile.x1; i++)
+            img[j * width + i] += scratch.tile_color[(j - tile.y0) * tile_w + (i - tile.x0)];
+}
+
+void RenderEngine::waitIfPaused() {
+    if (!paused)
+        return;
+    std::unique_lock<std::mutex> guard(pause_lock);
+    pause_cv.wait(guard, [this]() { return !paused; });
+}
+
+void RenderEngine::pause() {
+    paused = true;
+}
 
-    int i, j, k;
-    std::atomic<int> sum(0);
+void RenderEngine::resume() {
+    {
+        std::lock_guard<std::mutex> guard(pause_lock);
+        paused = false;
+    }
+    pause_cv.notify_all();
+}
 
-    auto reportProgress = [this, &sum]() {
-        int progress = static_cast<int>(100.0 * sum / height);
+void RenderEngine::stop() {
+    stop_requested = true;
+    resume();
+}
+
+void RenderEngine::renderPass(int spp, int first_sample, SampleMethod method, bool isOpenMP,
+                              std::vector<color> &img, int spp_done, int spp_total, std::vector<int> *counts) {
+    using namespace std::chrono;
+    int num_workers = isOpenMP ? getThreadCount() : 1;
+    const cpu_topology &topology = cpu_topology::get();
+    TileScheduler scheduler;
+    scheduler.init(width, height, tile_size, num_workers);
+    int num_tiles = scheduler.tileCount();
+
+    auto reportProgress = [this, num_tiles, spp, spp_done, spp_total](int sum) {
+        int progress = static_cast<int>(100.0 * (spp_done + spp * static_cast<double>(sum) / num_tiles) / spp_total);
         if (progressCallback) {
             progressCallback(progress);
         }
     };
-    if (isOpenMP) {
-        std::cout<<"OpenMP"<<std::endl;
-#pragma omp parallel for private(k, i, j) shared(img, sum)
-        for (k = 0; k < width * height; k++) {
-            j = k / width;
-            i = k % height;
-            img[k] = computePixelColor(i, j, spp, method);
-
-            if (i == 0) {
+#pragma omp parallel num_threads(num_workers) if(isOpenMP)
+    {
+        int worker = omp_get_thread_num();
+        // 先绑定再分配临时内存，内存页落在线程所在的NUMA结点上
+        thread_pin pin(pin_threads && isOpenMP ? topology.cpu_for_worker(worker, num_workers) : -1);
+        WorkerScratch scratch;
+        scratch.smp = sampler_proto->clone();
+        Tile tile;
+        while (scheduler.next(worker, tile)) {
+            waitIfPaused();
+            auto tile_start = high_resolution_clock::now();
+            renderTile(tile, spp, first_sample, method, scratch, img, counts);
+            duration<double, std::milli> tile_time = high_resolution_clock::now() - tile_start;
+            int sum = scheduler.finish(tile, tile_time.count());
 #pragma omp critical
-                {
-                    sum++;
-                    std::cerr << "\rScanlines remaining: " << height - sum << ' ' << std::flush;
-                    reportProgress();
-                }
+            {
+                std::cerr << "\rTiles remaining: " << num_tiles - sum << ' ' << std::flush;
+                reportProgress(sum);
             }
         }
     }
-    else {
-        sum = 0;
-        std::cout<<"No OpenMP"<<std::endl;
-        for (k = 0; k < width * height; k++) {
-            j = k / width;
-            i = k % height;
-            img[k] = computePixelColor(i, j, spp, method);
-            if (i == 0) {
-                sum++;
-                std::cerr << "\rScanlines remaining: " << height - sum << ' ' << std::flush;
-                reportProgress();
-            }
-        }
+    tile_timings = scheduler.getTiles();
+}
+
+// 场景中是否有阴影光线可以穿过的物体：镜面、玻璃和参与介质
+static bool has_transmissive(const hittable &object) {
+    if (auto list = dynamic_cast<const hittable_list *>(&object)) {
+        for (const auto &child: list->objects)
+            if (has_transmissive(*child)) return true;
+        return false;
+    }
+    if (auto node = dynamic_cast<const bvh_node *>(&object)) {
+        for (const auto &child: node->primitives)
+            if (has_transmissive(*child)) return true;
+        return false;
     }
+    if (auto t = dynamic_cast<const transform *>(&object)) {
+        auto inst = dynamic_cast<const instance *>(t);
+        if (!inst || !inst->mat_ptr)
+            return has_transmissive(*t->ptr);
+    }
+    shared_ptr<material> mat;
+    object.getMaterial(mat);
+    if (!mat)
+        return true; // 无法确定材质时按可以穿过处理
+    material_type m = material_type::Glass;
+    mat->getType(m);
+    return m == material_type::Metal || m == material_type::Glass || m == material_type::Isotropic;
+}
+
+void RenderEngine::buildAccel() {
+    using namespace std::chrono;
+    auto start = high_resolution_clock::now();
+    world = make_shared<top_level_bvh>(scene.world, 0, 1);
+    shadow_transmissive = has_transmissive(scene.world);
+    lights = scene.lights ? light_sampler(*scene.lights) : light_sampler();
+    duration<double> elapsed = high_resolution_clock::now() - start;
+    if (elapsed.count() > 0.75)
+        std::cout << "Building top-level BVH takes " << elapsed.count() << " seconds" << std::endl;
+}
+
+void RenderEngine::printThreadInfo(bool isOpenMP) const {
+    if (!isOpenMP) {
+        std::cout << "No OpenMP" << std::endl;
+        return;
+    }
+    std::cout << "OpenMP: " << getThreadCount() << " threads";
+    if (pin_threads)
+        std::cout << ", pinned across " << cpu_topology::get().node_count() << " NUMA node(s)";
+    std::cout << std::endl;
+}
+
+void RenderEngine::render(int spp, SampleMethod method, const std::string &img_name, bool isOpenMP) {
+    using namespace std::chrono;
+
+    auto start = high_resolution_clock::now();
+    std::cout << "Rendering..." << std::endl;
+    omp_set_num_threads(getThreadCount()); // 顶层BVH的并行构建也使用同样的线程数
+    buildAccel();
+    sampler_proto = create_sampler(sampler_kind, spp);
+    printThreadInfo(isOpenMP);
+    std::vector<color> img(width * height, color(0, 0, 0));
 
-    write_img(img_name.c_str(), width, height, img, spp);
+    if (adaptive.enabled) {
+        sample_counts.assign(width * height, 0);
+        renderPass(spp, 0, method, isOpenMP, img, 0, spp, &sample_counts);
+        write_img(img_name.c_str(), width, height, img, sample_counts);
+
+        long long total = 0;
+        for (int n: sample_counts)
+            total += n;
+        std::cerr << std::endl << "Adaptive: " << static_cast<double>(total) / sample_counts.size()
+                  << " spp on average, max " << spp;
+    } else {
+        sample_counts.clear();
+        renderPass(spp, 0, method, isOpenMP, img, 0, spp);
+        write_img(img_name.c_str(), width, height, img, spp);
+    }
 
     auto end = high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<seconds>(end - start);
 
-    std::cerr << std::endl << "Time Cost:"
+    std::cerr << std::endl;
+    TileScheduler::reportTiming(std::cerr, tile_timings);
+    std::cerr << "Time Cost:"
               << duration.count() / 60 << "min"
               << duration.count() % 60 << "s" << std::endl;
     std::cerr << "Writing to " << img_name << std::endl;
@@ -76,26 +219,62 @@ void RenderEngine::render(int spp, SampleMethod method, const std::string &img_n
 
 }
 
-color RenderEngine::ray_color(const ray &r, SampleMethod method) const {
+void RenderEngine::renderProgressive(int pass_spp, int max_spp, SampleMethod method, const std::string &img_name,
+                                     bool isOpenMP) {
+    using namespace std::chrono;
+    pass_spp = std::max(pass_spp, 1);
+    if (accum_buffer.size() != static_cast<size_t>(width * height)) {
+        accum_buffer.assign(width * height, color(0, 0, 0));
+        accum_spp = 0;
+    }
+    stop_requested = false;
+    paused = false;
+
+    auto start = high_resolution_clock::now();
+    std::cout << "Progressive rendering..." << std::endl;
+    omp_set_num_threads(getThreadCount()); // 顶层BVH的并行构建也使用同样的线程数
+    buildAccel();
+    sampler_proto = create_sampler(sampler_kind, max_spp);
+    printThreadInfo(isOpenMP);
+    int spp_begin = accum_spp;
+    while (accum_spp < max_spp && !stop_requested) {
+        int spp = std::min(pass_spp, max_spp - accum_spp);
+        // 采样序号接着上一遍继续，每一遍都是新的采样
+        renderPass(spp, accum_spp, method, isOpenMP, accum_buffer, accum_spp - spp_begin, max_spp - spp_begin);
+        accum_spp += spp;
+
+        write_img(img_name.c_str(), width, height, accum_buffer, accum_spp);
+        if (snapshotCallback)
+            snapshotCallback(accum_buffer, accum_spp);
+
+        duration<double> elapsed = high_resolution_clock::now() - start;
+        std::cerr << "\rPass done: " << accum_spp << "/" << max_spp << " spp, "
+                  << elapsed.count() << "s" << std::endl;
+    }
+    std::cerr << "Writing to " << img_name << std::endl;
+    std::cerr << "Done.\n" << std::endl;
+}
+
+color RenderEngine::ray_color(const ray &r, SampleMethod method, sampler &smp) const {
     color L(0, 0, 0);
     switch (method) {
         case SampleMethod::BRDF:
-            L = BRDF_sample(r);
+            L = BRDF_sample(r, smp);
             break;
         case SampleMethod::Light:
-            L = light_sample(r);
+            L = light_sample(r, smp);
             break;
         case SampleMethod::Mixture:
-            L = Mixture_sample(r);
+            L = Mixture_sample(r, smp);
             break;
         case SampleMethod::NEE:
-            L = NEE_sample(r, 0);
+            L = NEE_sample(r, smp);
             break;
         case SampleMethod::MIS:
-            L = Muliti_Importance_sample(r, 0, 1);
+            L = Muliti_Importance_sample(r, smp);
             break;
         default:
-            L = BRDF_sample(r);
+            L = BRDF_sample(r, smp);
             break;
     }
     if (isnan(L.x())) L[0] = 0;
@@ -104,296 +283,532 @@ color RenderEngine::ray_color(const ray &r, SampleMethod method) const {
     return L;
 }
 
-color RenderEngine::BRDF_sample(const ray &r) const {
-    hit_record rec;
-    // If the ray hits nothing, return the background color.
-    if (!scene.world.hit(r, 0.001, infinity, rec))
-        return scene.background->value(r);
-
-    scatter_record srec;
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+double RenderEngine::russian_roulette(int bounce, const color &beta, double p_RR) const {
+    // 前几次弹射使用固定的概率，之后根据路径通量决定，通量很小的路径会尽早结束
+    // 通量为0时返回0，调用者要直接结束路径：sampler可能给出0，不能只靠 get_1d() > p_RR 判断
+    if (bounce < rr_depth)
+        return p_RR;
+    double max_beta = fmax(beta.x(), fmax(beta.y(), beta.z()));
+    return fmin(p_RR, max_beta);
+}
 
-    if (!rec.mat_ptr->scatter(r, rec, srec))
-        return emitted;
+/*  以下的积分器都是迭代形式：
+    L 为累计的辐射度，beta 为路径通量(之前所有顶点的 BRDF*cos/pdf 以及俄罗斯轮盘赌的权重之积)，
+    每次弹射最多 max_depth 次，路径也可能被俄罗斯轮盘赌提前结束。
+*/
+color RenderEngine::BRDF_sample(const ray &r, sampler &smp) const {
+    color L(0, 0, 0), beta(1, 1, 1);
+    ray cur_ray = r;
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+        hit_record rec;
+        // If the ray hits nothing, return the background color.
+        if (!world->hit(cur_ray, 0.001, infinity, rec)) {
+            L += beta * scene.background->value(cur_ray);
+            break;
+        }
 
-    float p_RR = 0.9;     // 概率反射系数
-    if (random_double() > p_RR)
-        return color(0, 0, 0);
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(cur_ray, rec, rec.u, rec.v, rec.p);
+        L += beta * emitted;
+        if (!rec.mat_ptr->scatter(cur_ray, rec, srec))
+            break;
 
-    if (srec.is_specular) {
-        return srec.attenuation
-               * BRDF_sample(srec.scatter_ray) / p_RR;
-    }
+        double p_RR = russian_roulette(bounce, beta, 0.9);     // 概率反射系数
+        if (p_RR <= 0 || smp.get_1d() > p_RR)
+            break;
 
-    auto light_ptr = make_shared<hittable_pdf>(scene.lights, rec.p);
-    ray scatter_ray = ray(rec.p, srec.pdf_ptr->generate(), r.time());
-    auto pdf_val = srec.pdf_ptr->value(scatter_ray.direction());
+        if (srec.is_specular) {
+            beta = beta * srec.attenuation / p_RR;
+            cur_ray = srec.scatter_ray;
+            continue;
+        }
 
-    return emitted
-           + srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scatter_ray)
-             * BRDF_sample(scatter_ray) / p_RR / pdf_val;
+        ray scatter_ray = ray(rec.p, srec.dir_pdf.generate(smp.get_2d()), cur_ray.time());
+        auto pdf_val = srec.dir_pdf.value(scatter_ray.direction());
+        beta = beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, scatter_ray) / p_RR / pdf_val;
+        cur_ray = scatter_ray;
+    }
+    return L;
 }
 
-color RenderEngine::light_sample(const ray &r) const {
-    hit_record rec;
-    // If the ray hits nothing, return the background color.
-    if (!scene.world.hit(r, 0.001, infinity, rec))
-        return scene.background->value(r);
-
-    scatter_record srec;
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+color RenderEngine::light_sample(const ray &r, sampler &smp) const {
+    color L(0, 0, 0), beta(1, 1, 1);
+    ray cur_ray = r;
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+        hit_record rec;
+        // If the ray hits nothing, return the background color.
+        if (!world->hit(cur_ray, 0.001, infinity, rec)) {
+            L += beta * scene.background->value(cur_ray);
+            break;
+        }
 
-    if (!rec.mat_ptr->scatter(r, rec, srec))
-        return emitted;
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(cur_ray, rec, rec.u, rec.v, rec.p);
+        L += beta * emitted;
+        if (!rec.mat_ptr->scatter(cur_ray, rec, srec))
+            break;
 
-    float p_RR = 0.9;     // 概率反射系数
-    if (random_double() > p_RR)
-        return color(0, 0, 0);
+        double p_RR = russian_roulette(bounce, beta, 0.9);     // 概率反射系数
+        if (p_RR <= 0 || smp.get_1d() > p_RR)
+            break;
 
-    if (srec.is_specular) {
-        return srec.attenuation
-               * light_sample(srec.scatter_ray) / p_RR;
-    }
+        if (srec.is_specular) {
+            beta = beta * srec.attenuation / p_RR;
+            cur_ray = srec.scatter_ray;
+            continue;
+        }
 
-    auto light_ptr = make_shared<hittable_pdf>(scene.lights, rec.p);
-    ray scatter_ray = ray(rec.p, light_ptr->generate(), r.time());
-    auto pdf_val = light_ptr->value(scatter_ray.direction());
-    if (pdf_val) {
-        return emitted
-               + srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scatter_ray)
-                 * light_sample(scatter_ray) / p_RR / pdf_val;
-    } else {
-        return emitted;
+        // 沿光源方向继续的路径可能先遇到其他光源，pdf是所有光源的加权和
+        double u_pick = smp.get_1d();
+        pointd2 u_light = smp.get_2d();
+        light_record ls;
+        if (!lights.sample(rec.p, cur_ray.time(), u_pick, u_light, ls))
+            break;
+        ray scatter_ray = ray(rec.p, ls.dir, cur_ray.time());
+        auto pdf_val = lights.pdf_value(rec.p, ls.dir);
+        if (!pdf_val)
+            break;
+        beta = beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, scatter_ray) / p_RR / pdf_val;
+        cur_ray = scatter_ray;
     }
+    return L;
 }
 
-color RenderEngine::Mixture_sample(const ray &r) const {
-    hit_record rec;
-
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-//    if (depth <= 0)
-//        return color(0,0,0);
+color RenderEngine::Mixture_sample(const ray &r, sampler &smp) const {
+    color L(0, 0, 0), beta(1, 1, 1);
+    ray cur_ray = r;
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+        hit_record rec;
+        // If the ray hits nothing, return the background color.
+        if (!world->hit(cur_ray, 0.001, infinity, rec)) {
+            L += beta * scene.background->value(cur_ray);
+            break;
+        }
 
-    // If the ray hits nothing, return the background color.
-    if (!scene.world.hit(r, 0.001, infinity, rec))
-        return scene.background->value(r);
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(cur_ray, rec, rec.u, rec.v, rec.p);
+        L += beta * emitted;
+        if (!rec.mat_ptr->scatter(cur_ray, rec, srec))
+            break;
 
-    scatter_record srec;
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+        double p_RR = russian_roulette(bounce, beta, 0.9);     // 概率反射系数
+        if (p_RR <= 0 || smp.get_1d() > p_RR)
+            break;
 
-    if (!rec.mat_ptr->scatter(r, rec, srec))
-        return emitted;
-    float p_RR = 0.9;     // 概率反射系数
-    if (random_double() > p_RR)
-        return color(0, 0, 0);
+        if (srec.is_specular) {
+            beta = beta * srec.attenuation / p_RR;
+            cur_ray = srec.scatter_ray;
+            continue;
+        }
 
-    if (srec.is_specular) {
-        return srec.attenuation
-               * Mixture_sample(srec.scatter_ray) / p_RR;
+        // 光源和BRDF各占一半的混合分布
+        vecf3 dir;
+        if (smp.get_1d() < 0.5) {
+            double u_pick = smp.get_1d();
+            pointd2 u_light = smp.get_2d();
+            light_record ls;
+            if (!lights.sample(rec.p, cur_ray.time(), u_pick, u_light, ls))
+                break;
+            dir = ls.dir;
+        } else {
+            dir = srec.dir_pdf.generate(smp.get_2d());
+        }
+        ray scatter_ray = ray(rec.p, dir, cur_ray.time());
+        auto pdf_val = 0.5 * lights.pdf_value(rec.p, dir) + 0.5 * srec.dir_pdf.value(dir);
+        beta = beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, scatter_ray) / pdf_val / p_RR;
+        cur_ray = scatter_ray;
     }
-
-    auto light_ptr = make_shared<hittable_pdf>(scene.lights, rec.p);
-    mixture_pdf p(light_ptr, srec.pdf_ptr);
-    ray scatter_ray = ray(rec.p, p.generate(), r.time());
-    auto pdf_val = p.value(scatter_ray.direction());
-
-    return emitted
-           + srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scatter_ray)
-             * Mixture_sample(scatter_ray)
-             / pdf_val / p_RR;
+    return L;
 }
 
-color RenderEngine::NEE_sample(const ray &r, int depth, bool is_shadow) const {
-
-    struct hit_record rec;
-    float p_RR = 0.95;                        // 概率反射系数
+/*  trace_shadow: 沿着指向光源采样点ls的阴影光线追踪，返回到达的光源(或背景)的辐射度乘以weight
+
+    阴影光线可以穿过镜面/玻璃(按俄罗斯轮盘赌继续)和参与介质(按介质密度衰减)，
+    遇到其他会散射的表面则被遮挡。
+    采样点的距离和辐射度在采样时已经得到，到采样点之间没有任何物体时直接返回，只需要一次遮挡测试；
+    有遮挡且场景中存在可以透过阴影光线的物体时，才需要完整地追踪。
+*/
+color RenderEngine::trace_shadow(const ray &r, const light_record &ls, double weight, double p_RR, double t_min) const {
+    if (!world->occluded(r, t_min, ls.dist * (1 - 1e-5)))
+        return ls.radiance * weight;
+    if (!shadow_transmissive)
+        return color(0, 0, 0);
+    return trace_shadow_blocked(r, weight, p_RR, t_min);
+}
 
-    if (!scene.world.hit(r, 0.0001, infinity, rec)) // 在0-infinity范围内找最近邻的表面
-        return scene.background->value(r);
-    //srec 用于记录该材质的散射信息，包括衰减系数，散射光线方向分布，是否为镜面反射
-    struct scatter_record srec;
+color RenderEngine::trace_shadow_blocked(const ray &r, double weight, double p_RR, double t_min) const {
+    color beta(1, 1, 1);
+    ray cur_ray = r;
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+        hit_record rec;
+        if (!world->hit(cur_ray, t_min, infinity, rec))
+            return beta * scene.background->value(cur_ray) * weight;
+
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(cur_ray, rec, rec.u, rec.v, rec.p);
+        if (!rec.mat_ptr->scatter(cur_ray, rec, srec))
+            return beta * emitted * weight;
+
+        vecf3 dir = cur_ray.direction();
+        if (srec.is_medium) {
+            struct hit_record rec_lgt;
+            ray shadow_ray = ray(rec.p + dir * 0.001, dir, cur_ray.time());
+            if (rec.boundary_ptr->hit(shadow_ray, 0.001, infinity, rec_lgt)) { // 在0-infinity范围内找到内表面位置
+                // 穿过介质后按照密度衰减
+                double light_trans_distance = (rec_lgt.p - rec.p).length();
+                double light_attenuation = exp(-rec.density * light_trans_distance);
+                beta = beta * srec.attenuation * light_attenuation;
+                shadow_ray = ray(rec_lgt.p + dir * 0.001, dir, cur_ray.time());
+            }
+            cur_ray = shadow_ray;
+            continue;
+        }
 
-    //除了光源以外，自发光emitted都是黑色的(0,0,0)
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p); // 发射光线的颜色
-    if (!rec.mat_ptr->scatter(r, rec, srec)) {
-        if (is_shadow || depth == 0)
-            return emitted;
-        else
+        if (random_double() > p_RR)
             return color(0, 0, 0);
-    } else if (srec.is_medium && is_shadow) {
-        struct hit_record rec_lgt;
-        ray shadow_ray = ray(rec.p + r.direction() * 0.001, r.direction(), r.time());
-        if (!rec.boundary_ptr->hit(shadow_ray, 0.001, infinity, rec_lgt)) { // 在0-infinity范围内找到内表面位置
-            return NEE_sample(shadow_ray, depth + 1, true);
-        } else {
-            shadow_ray = ray(rec_lgt.p + r.direction() * 0.001, r.direction(), r.time());
-            double light_trans_distance = (rec_lgt.p - rec.p).length();
-            double light_attenuation = exp(-rec.density * light_trans_distance);
-            return srec.attenuation * light_attenuation *
-                   NEE_sample(shadow_ray, depth + 1, true);
+        if (srec.is_specular || srec.is_refract) {
+            beta = beta * srec.attenuation / p_RR;
+            cur_ray = srec.scatter_ray;
+            continue;
         }
-    }
-
-    if (random_double() > p_RR)
-        return color(0, 0, 0);
-    if (srec.is_specular||srec.is_refract) {
-        return srec.attenuation * NEE_sample(srec.scatter_ray, depth, is_shadow) / p_RR;
-    }
-    if (is_shadow) {
+        //若光线没有追踪到光源，不是镜面反射，且是最后的shadow ray 则返回0
         return color(0, 0, 0);
     }
+    return color(0, 0, 0);
+}
 
-    //若光线没有追踪到光源，不是镜面反射，且是最后的shadow ray 则返回0
-    //直接光照
-    auto light_pdf_ptr = make_shared<hittable_pdf>(scene.lights, rec.p);
-    vecf3 light_direction = unit_vector(light_pdf_ptr->generate());
-    ray shadow_ray = ray(rec.p, light_direction, r.time());
-    double p_dir = light_pdf_ptr->value(shadow_ray.direction());
-    color direct_light, indirect_light;
-
-    material_type m;
-    rec.mat_ptr->getType(m);
-    if (m != material_type::Isotropic) {
-        if (p_dir) {
-            direct_light = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, shadow_ray)
-                           * NEE_sample(shadow_ray, depth + 1, true) / p_dir;
-        }
-    } else {//处理体渲染
-        struct hit_record rec_lgt;
-        if (!rec.boundary_ptr->hit(shadow_ray, 0.001, infinity, rec_lgt)) { // 在0-infinity范围内找到内表面位置
-            if (p_dir)
-                direct_light = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, shadow_ray) *
-                               NEE_sample(shadow_ray, depth + 1, true)
-                               / p_dir;
-        } else {
-//            shadow_ray = ray(rec_lgt.p+light_direction*0.001,light_direction,r.time());
-//            double light_trans_distance = (rec_lgt.p-rec.p).length();
-//            double light_attenuation = exp(-rec.density*light_trans_distance);
-//            if (p_dir)
-//                direct_light =srec.attenuation *light_attenuation* rec.mat_ptr->scattering_pdf(r, rec, shadow_ray)*
-//                              NEE_ray_color(shadow_ray, scene, depth + 1,  true)
-//                              / p_dir;
-            direct_light = color(0, 0, 0);
+color RenderEngine::NEE_sample(const ray &r, sampler &smp) const {
+    color L(0, 0, 0), beta(1, 1, 1);
+    ray cur_ray = r;
+    int depth = 0;  // 经过的非镜面弹射次数，只有相机(经镜面)直接看到的光源才计入，其余由直接光照计算
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+        struct hit_record rec;
+        if (!world->hit(cur_ray, 0.0001, infinity, rec)) { // 在0-infinity范围内找最近邻的表面
+            L += beta * scene.background->value(cur_ray);
+            break;
+        }
+        //srec 用于记录该材质的散射信息，包括衰减系数，散射光线方向分布，是否为镜面反射
+        struct scatter_record srec;
+
+        //除了光源以外，自发光emitted都是黑色的(0,0,0)
+        color emitted = rec.mat_ptr->emitted(cur_ray, rec, rec.u, rec.v, rec.p); // 发射光线的颜色
+        if (!rec.mat_ptr->scatter(cur_ray, rec, srec)) {
+            if (depth == 0)
+                L += beta * emitted;
+            break;
         }
-    }
-    //间接光照
-    vecf3 scattered_direction = unit_vector(srec.pdf_ptr->generate());
-    ray scatter_ray = ray(rec.p, scattered_direction, r.time());
-    double p_indir = srec.pdf_ptr->value(scattered_direction);
-    indirect_light = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scatter_ray)
-                     * NEE_sample(scatter_ray, depth + 1, false) / p_indir;
-
-    return emitted + (direct_light + indirect_light) / p_RR;
-}
 
-color RenderEngine::Muliti_Importance_sample(const ray &r, int depth, double emitted_weight, bool is_shadow) const {
+        double p_RR = russian_roulette(bounce, beta, 0.95);   // 概率反射系数
+        if (p_RR <= 0 || smp.get_1d() > p_RR)
+            break;
+        if (srec.is_specular || srec.is_refract) {
+            beta = beta * srec.attenuation / p_RR;
+            cur_ray = srec.scatter_ray;
+            continue;
+        }
 
+        //直接光照：一次采样同时得到方向、距离、辐射度和pdf
+        double u_pick = smp.get_1d();
+        pointd2 u_light = smp.get_2d();
+        light_record ls;
+        bool has_light_sample = lights.sample(rec.p, cur_ray.time(), u_pick, u_light, ls);
+        //间接光照的方向在追踪阴影光线之前采样，与MIS中取随机数的顺序一致
+        vecf3 scattered_direction = unit_vector(srec.dir_pdf.generate(smp.get_2d()));
+        if (has_light_sample) {
+            ray shadow_ray = ray(rec.p, ls.dir, cur_ray.time());
+            material_type m;
+            rec.mat_ptr->getType(m);
+            bool light_visible = true;
+            if (m == material_type::Isotropic) {//处理体渲染
+                // 阴影光线需要先穿出介质的边界，否则不计直接光照
+                light_visible = !rec.boundary_ptr->occluded(shadow_ray, 0.001, infinity);
+            }
+            if (light_visible) {
+                L += beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, shadow_ray)
+                     * trace_shadow(shadow_ray, ls, 1, 0.95, 0.0001) / ls.pdf / p_RR;
+            }
+        }
 
-//    if(depth>=max_depth)
-//        return color(0,0,0);
-    struct hit_record rec;
-    color result;
-    if (!scene.world.hit(r, 0.001, infinity, rec)) { // 在0-infinity范围内找最近邻的表面
-        return scene.background->value(r) * emitted_weight;
+        //间接光照
+        ray scatter_ray = ray(rec.p, scattered_direction, cur_ray.time());
+        double p_indir = srec.dir_pdf.value(scattered_direction);
+        beta = beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, scatter_ray) / p_indir / p_RR;
+        cur_ray = scatter_ray;
+        depth++;
     }
-    //srec 用于记录该材质的散射信息，包括衰减系数，散射光线方向分布，是否为镜面反射
-    struct scatter_record srec;
-    //如果光线追踪到光源，则返回光源的颜色
-    color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p); // 发射光线的颜色
-    if (!rec.mat_ptr->scatter(r, rec, srec)) {
-        return emitted * emitted_weight;
-    } else if (srec.is_medium && is_shadow) {
-        struct hit_record rec_lgt;
-        ray shadow_ray = ray(rec.p + r.direction() * 0.001, r.direction(), r.time());
-        if (!rec.boundary_ptr->hit(shadow_ray, 0.001, infinity, rec_lgt)) { // 在0-infinity范围内找到内表面位置
-            return Muliti_Importance_sample(shadow_ray, depth + 1, emitted_weight, true);
-        } else {
-            shadow_ray = ray(rec_lgt.p + r.direction() * 0.001, r.direction(), r.time());
-            double light_trans_distance = (rec_lgt.p - rec.p).length();
-            double light_attenuation = exp(-0.01 * light_trans_distance);
-            return srec.attenuation * light_attenuation *
-                   Muliti_Importance_sample(shadow_ray, depth + 1, emitted_weight, true);
+    return L;
+}
+
+color RenderEngine::Muliti_Importance_sample(const ray &r, sampler &smp) const {
+    color L(0, 0, 0), beta(1, 1, 1);
+    ray cur_ray = r;
+    double emitted_weight = 1;  // 下一个顶点的自发光(或背景)的MIS权重
+    for (int bounce = 0; bounce < max_depth; bounce++) {
+        struct hit_record rec;
+        if (!world->hit(cur_ray, 0.001, infinity, rec)) { // 在0-infinity范围内找最近邻的表面
+            L += beta * scene.background->value(cur_ray) * emitted_weight;
+            break;
+        }
+        //srec 用于记录该材质的散射信息，包括衰减系数，散射光线方向分布，是否为镜面反射
+        struct scatter_record srec;
+        //如果光线追踪到光源，则返回光源的颜色
+        color emitted = rec.mat_ptr->emitted(cur_ray, rec, rec.u, rec.v, rec.p); // 发射光线的颜色
+        if (!rec.mat_ptr->scatter(cur_ray, rec, srec)) {
+            L += beta * emitted * emitted_weight;
+            break;
         }
-    }
 
-    //Russia Rotate
-    float p_RR = 0.9;     // 概率反射系数
-    if (random_double() > p_RR)
-        return color(0, 0, 0);
+        //Russia Rotate
+        double p_RR = russian_roulette(bounce, beta, 0.9);     // 概率反射系数
+        if (p_RR <= 0 || smp.get_1d() > p_RR)
+            break;
 
-    //如果是镜面反射，直接返回镜面反射的颜色，不依赖于光源
-    if (srec.is_specular) {
-        return srec.attenuation * Muliti_Importance_sample(srec.scatter_ray, depth, emitted_weight, is_shadow) / p_RR;
+        //如果是镜面反射，直接返回镜面反射的颜色，不依赖于光源
+        if (srec.is_specular || srec.is_refract) {
+            beta = beta * srec.attenuation / p_RR;
+            cur_ray = srec.scatter_ray;
+            continue;
+        }
+        ray shadow_ray, scatter_ray;
+        double mis_brdf_sample, mis_light_sample, mis_tmp;
+        double p_indir, p_dir_tmp, p_indir_tmp;
+
+        //直接光照：采样时已经得到pdf，不需要再与光源求交
+        double u_pick = smp.get_1d();
+        pointd2 u_light = smp.get_2d();
+        light_record ls;
+        bool has_light_sample = lights.sample(rec.p, cur_ray.time(), u_pick, u_light, ls);
+        //间接光照
+        scatter_ray = ray(rec.p, unit_vector(srec.dir_pdf.generate(smp.get_2d())), cur_ray.time());
+        p_indir = srec.dir_pdf.value(scatter_ray.direction());
+        //启发式平衡函数，这正是MIS的权重函数，BRDF采样方向的光源pdf直接由各个光源解析地计算
+        p_dir_tmp = lights.pdf_value(rec.p, scatter_ray.direction());
+        balance_heuristic(p_indir, p_dir_tmp, mis_brdf_sample, mis_tmp, 2);
+
+        material_type m;
+        rec.mat_ptr->getType(m);
+        if (m == material_type::Isotropic)
+            mis_brdf_sample = 1; //处理体渲染：BRDF采样的光线不做MIS
+        if (has_light_sample) {
+            shadow_ray = ray(rec.p, ls.dir, cur_ray.time());
+            p_indir_tmp = srec.dir_pdf.value(ls.dir);
+            balance_heuristic(p_indir_tmp, ls.pdf, mis_tmp, mis_light_sample, 2);
+            //处理体渲染：阴影光线需要先穿出介质的边界
+            bool light_visible = m != material_type::Isotropic ||
+                                 !rec.boundary_ptr->occluded(shadow_ray, 0.001, infinity);
+            if (light_visible) {
+                L += beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, shadow_ray)
+                     * trace_shadow(shadow_ray, ls, mis_light_sample, 0.9, 0.001) / ls.pdf / p_RR;
+            }
+        }
+
+        if (!p_indir)
+            break;
+        beta = beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, scatter_ray) / p_indir / p_RR;
+        cur_ray = scatter_ray;
+        emitted_weight = mis_brdf_sample;
     }
-    if (srec.is_refract) {
-        return srec.attenuation * Muliti_Importance_sample(srec.scatter_ray, depth + 1, is_shadow) / p_RR;
+    return L;
+}
+
+/*  wavefront渲染
+
+    与NEE_sample和Muliti_Importance_sample的每一步相同，只是一批路径的同一步放在一起执行。
+    块内的路径按(像素, 采样)的顺序编号，每批取连续的至多wavefront_batch条，一个像素的采样可以分在相邻的两批中。
+    每批结束后按顺序累加到像素上，结果与逐条路径渲染逐位相同。
+*/
+void RenderEngine::renderTileWavefront(const Tile &tile, int spp, int first_sample, SampleMethod method,
+                                       WorkerScratch &scratch) const {
+    sampler *smp = scratch.smp.get();
+    PathBatch &batch = scratch.batch; // 同一个线程的各个块复用
+    int num_paths = (tile.x1 - tile.x0) * (tile.y1 - tile.y0) * spp;
+    for (int first = 0; first < num_paths; first += wavefront_batch) {
+        int count = std::min(wavefront_batch, num_paths - first);
+        batch.resize(count);
+        wavefrontGenerate(batch, tile, first, spp, first_sample, *smp);
+        for (int bounce = 0; bounce < max_depth && !batch.active.empty(); bounce++) {
+            wavefrontIntersect(batch, bounce, method, *smp);
+            batch.sortByMaterial();
+            wavefrontShade(batch, bounce, method, *smp);
+            wavefrontShadow(batch, method, *smp);
+        }
+        // 累加，tile_color在块开始时清零，同一个像素的采样总是按顺序加入
+        for (int k = 0; k < count; k++) {
+            color L = batch.getL(k);
+            if (isnan(L.x())) L[0] = 0;
+            if (isnan(L.y())) L[1] = 0;
+            if (isnan(L.z())) L[2] = 0;
+            scratch.tile_color[(first + k) / spp] += L;
+        }
     }
-    //若光线没有追踪到光源，不是镜面反射，且是最后的shadow ray 则返回0
-    if (is_shadow) {
-        return color(0, 0, 0);
+}
+
+void RenderEngine::wavefrontGenerate(PathBatch &batch, const Tile &tile, int first_path, int spp,
+                                     int first_sample, sampler &smp) const {
+    int tile_w = tile.x1 - tile.x0;
+    for (int k = 0; k < batch.size(); k++) {
+        int pixel_index = (first_path + k) / spp;
+        int i = tile.x0 + pixel_index % tile_w;
+        int j = tile.y0 + pixel_index / tile_w;
+        uint64_t pixel_key = static_cast<uint64_t>(j) * width + i + seed * 0x9e3779b97f4a7c15ULL;
+        smp.start_pixel_sample(i, j, first_sample + (first_path + k) % spp, pixel_key);
+        pointd2 pixel = smp.get_pixel_2d();
+        double u = (i + pixel.x()) / (width - 1);
+        double v = (j + pixel.y()) / (height - 1);
+        pointd2 lens = smp.get_2d();
+        batch.setRay(k, scene.cam->get_ray(u, v, lens, smp.get_1d()));
+        smp.save_state(batch.rng[k]);
     }
-    shared_ptr<hittable_pdf> light_pdf_ptr;
-    vecf3 light_direction;
-    ray shadow_ray, scatter_ray;
-    double mis_brdf_sample, mis_light_sample, mis_tmp;
-    double p_dir, p_indir, p_dir_tmp, p_indir_tmp;
-    color direct_light(0, 0, 0), indirect_light(0, 0, 0);
-
-    //直接光照
-    light_pdf_ptr = make_shared<hittable_pdf>(scene.lights, rec.p);
-    light_direction = unit_vector(light_pdf_ptr->generate());
-    shadow_ray = ray(rec.p, light_direction, r.time());
-    p_dir = light_pdf_ptr->value(shadow_ray.direction());
-    //间接光照
-    scatter_ray = ray(rec.p, unit_vector(srec.pdf_ptr->generate()), r.time());
-    p_indir = srec.pdf_ptr->value(scatter_ray.direction());
-    //启发式平衡函数，这正是MIS的权重函数
-    p_dir_tmp = light_pdf_ptr->value(scatter_ray.direction());
-    p_indir_tmp = srec.pdf_ptr->value(shadow_ray.direction());
-    balance_heuristic(p_indir, p_dir_tmp, mis_brdf_sample, mis_tmp, 2);
-    balance_heuristic(p_indir_tmp, p_dir, mis_tmp, mis_light_sample, 2);
-
-
-    //处理一般渲染
-    material_type m;
-    rec.mat_ptr->getType(m);
-    if (m != material_type::Isotropic) {
-        if (p_dir) {
-            direct_light = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, shadow_ray)
-                           * Muliti_Importance_sample(shadow_ray, depth + 1, mis_light_sample, true) / p_dir;
-        }
-
-        if (p_indir) {
-            indirect_light = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scatter_ray)
-                             * Muliti_Importance_sample(scatter_ray, depth + 1, mis_brdf_sample) / p_indir;
-        }
+}
 
-    } else {
-        //处理体渲染
-        struct hit_record rec_lgt;
-        if (!rec.boundary_ptr->hit(shadow_ray, 0.001, infinity, rec_lgt)) { // 在0-infinity范围内找到内表面位置
-            if (p_dir)
-                direct_light = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, shadow_ray) *
-                               Muliti_Importance_sample(shadow_ray, depth + 1, mis_light_sample, true)
-                               / p_dir;
+// 求交，没有交点的路径加上背景后结束。相机光线按包一起求交
+void RenderEngine::wavefrontIntersect(PathBatch &batch, int bounce, SampleMethod method, sampler &smp) const {
+    double t_min = method == SampleMethod::NEE ? 0.0001 : 0.001;
+    int n = 0;
+    auto finish = [&](int p, const ray &r, bool hit) {
+        if (hit) {
+            batch.active[n++] = p;
+        } else if (method == SampleMethod::NEE) {
+            batch.addL(p, batch.getBeta(p) * scene.background->value(r));
         } else {
-//            shadow_ray = ray(rec_lgt.p+light_direction*0.001,light_direction,r.time());
-//            double light_trans_distance = (rec_lgt.p-rec.p).length();
-//            double light_attenuation = exp(-0.01*light_trans_distance);
-//            if (p_dir)
-//                direct_light =srec.attenuation *light_attenuation* rec.mat_ptr->scattering_pdf(r, rec, shadow_ray)*
-//                              MIS_ray_color(shadow_ray, scene, depth + 1, mis_light_sample, true)
-//                              / p_dir;
-            direct_light = color(0, 0, 0);
+            batch.addL(p, batch.getBeta(p) * scene.background->value(r) * batch.emitted_weight[p]);
         }
-
-        if (p_indir) {
-            indirect_light = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scatter_ray)
-                             * Muliti_Importance_sample(scatter_ray, depth + 1, 1) / p_indir;
+    };
+    int num_active = static_cast<int>(batch.active.size());
+    if (ray_packets && bounce == 0) {
+        ray rays[bvh_packet::max_size];
+        double t_max[bvh_packet::max_size];
+        hit_record recs[bvh_packet::max_size];
+        pcg32 rngs[bvh_packet::max_size];
+        for (int first = 0; first < num_active; first += bvh_packet::max_size) {
+            int count = std::min(bvh_packet::max_size, num_active - first);
+            for (int k = 0; k < count; k++) {
+                int p = batch.active[first + k];
+                rays[k] = batch.getRay(p);
+                t_max[k] = infinity;
+                rngs[k] = batch.rng[p].rng;
+            }
+            uint32_t hits = world->hit_packet(rays, (1u << count) - 1, t_min, t_max, recs, rngs);
+            for (int k = 0; k < count; k++) {
+                int p = batch.active[first + k];
+                batch.rec[p] = recs[k];
+                batch.rng[p].rng = rngs[k];
+                finish(p, rays[k], (hits >> k) & 1);
+            }
+        }
+    } else {
+        for (int k = 0; k < num_active; k++) {
+            int p = batch.active[k];
+            ray r = batch.getRay(p);
+            smp.restore_state(batch.rng[p]); // 参与介质的求交会用到random_double()
+            bool hit = world->hit(r, t_min, infinity, batch.rec[p]);
+            smp.save_state(batch.rng[p]);
+            finish(p, r, hit);
         }
     }
+    batch.active.resize(n);
+}
+
+// 按材质的顺序着色：自发光、俄罗斯轮盘赌、光源采样(放入阴影光线队列)和BRDF采样下一条光线
+void RenderEngine::wavefrontShade(PathBatch &batch, int bounce, SampleMethod method, sampler &smp) const {
+    const bool nee = method == SampleMethod::NEE;
+    const double rr = nee ? 0.95 : 0.9;
+    batch.clearShadow();
+    batch.active.clear();
+    for (int p: batch.sorted) {
+        const hit_record &rec = batch.rec[p];
+        ray cur_ray = batch.getRay(p);
+        color beta = batch.getBeta(p);
+        smp.restore_state(batch.rng[p]);
+
+        scatter_record srec;
+        color emitted = rec.mat_ptr->emitted(cur_ray, rec, rec.u, rec.v, rec.p);
+        if (!rec.mat_ptr->scatter(cur_ray, rec, srec)) {
+            if (!nee)
+                batch.addL(p, beta * emitted * batch.emitted_weight[p]);
+            else if (batch.depth[p] == 0)
+                batch.addL(p, beta * emitted);
+            continue;
+        }
+        double p_RR = russian_roulette(bounce, beta, rr);
+        if (p_RR <= 0 || smp.get_1d() > p_RR)
+            continue;
+        if (srec.is_specular || srec.is_refract) {
+            batch.setBeta(p, beta * srec.attenuation / p_RR);
+            batch.setRay(p, srec.scatter_ray);
+            smp.save_state(batch.rng[p]);
+            batch.active.push_back(p);
+            continue;
+        }
 
+        double u_pick = smp.get_1d();
+        pointd2 u_light = smp.get_2d();
+        light_record ls;
+        bool has_light_sample = lights.sample(rec.p, cur_ray.time(), u_pick, u_light, ls);
+        ray scatter_ray = ray(rec.p, unit_vector(srec.dir_pdf.generate(smp.get_2d())), cur_ray.time());
+        double p_indir = srec.dir_pdf.value(scatter_ray.direction());
+        material_type m = static_cast<material_type>(batch.material_key[p]);
+        double mis_light_sample = 1, mis_brdf_sample = 1, mis_tmp;
+        if (!nee) {
+            balance_heuristic(p_indir, lights.pdf_value(rec.p, scatter_ray.direction()), mis_brdf_sample, mis_tmp, 2);
+            if (m == material_type::Isotropic)
+                mis_brdf_sample = 1;
+        }
+        if (has_light_sample) {
+            ray shadow_ray = ray(rec.p, ls.dir, cur_ray.time());
+            if (!nee)
+                balance_heuristic(srec.dir_pdf.value(ls.dir), ls.pdf, mis_tmp, mis_light_sample, 2);
+            bool light_visible = m != material_type::Isotropic ||
+                                 !rec.boundary_ptr->occluded(shadow_ray, 0.001, infinity);
+            if (light_visible)
+                batch.pushShadow(p, ls.dir, ls, beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, shadow_ray),
+                                 p_RR, mis_light_sample);
+        }
+        smp.save_state(batch.rng[p]);
+        if (!nee && !p_indir)
+            continue;
+        batch.setBeta(p, beta * srec.attenuation * rec.mat_ptr->scattering_pdf(cur_ray, rec, scatter_ray) / p_indir / p_RR);
+        batch.setRay(p, scatter_ray);
+        batch.emitted_weight[p] = mis_brdf_sample;
+        batch.depth[p]++;
+        batch.active.push_back(p);
+    }
+}
 
-    result = emitted + (direct_light + indirect_light) / p_RR;
-    return result;
-}
\ No newline at end of file
+// 阴影光线：先按包做遮挡测试，被遮挡且场景中有透明物体时才逐条完整地追踪
+void RenderEngine::wavefrontShadow(PathBatch &batch, SampleMethod method, sampler &smp) const {
+    const bool nee = method == SampleMethod::NEE;
+    const double t_min = nee ? 0.0001 : 0.001;
+    const double p_RR = nee ? 0.95 : 0.9;
+    ray rays[bvh_packet::max_size];
+    double t_max[bvh_packet::max_size];
+    pcg32 rngs[bvh_packet::max_size];
+    for (int first = 0; first < batch.shadowCount(); first += bvh_packet::max_size) {
+        int count = std::min(bvh_packet::max_size, batch.shadowCount() - first);
+        for (int j = 0; j < count; j++) {
+            int k = first + j, p = batch.shadow_path[k];
+            rays[j] = ray(batch.rec[p].p, vecf3(batch.shadow_dir_x[k], batch.shadow_dir_y[k], batch.shadow_dir_z[k]),
+                          batch.time[p]);
+            t_max[j] = batch.shadow_dist[k] * (1 - 1e-5);
+            rngs[j] = batch.rng[p].rng;
+        }
+        uint32_t mask = (1u << count) - 1;
+        uint32_t occluded = ray_packets ? world->occluded_packet(rays, mask, t_min, t_max, rngs)
+                                        : world->hittable::occluded_packet(rays, mask, t_min, t_max, rngs);
+        for (int j = 0; j < count; j++) {
+            int k = first + j, p = batch.shadow_path[k];
+            batch.rng[p].rng = rngs[j];
+            double weight = nee ? 1 : batch.shadow_weight[k];
+            color Ld(0, 0, 0);
+            if (!((occluded >> j) & 1)) {
+                Ld = color(batch.shadow_radiance_r[k], batch.shadow_radiance_g[k], batch.shadow_radiance_b[k]) * weight;
+            } else if (shadow_transmissive) {
+                smp.restore_state(batch.rng[p]);
+                Ld = trace_shadow_blocked(rays[j], weight, p_RR, t_min);
+                smp.save_state(batch.rng[p]);
+            }
+            color factor(batch.factor_r[k], batch.factor_g[k], batch.factor_b[k]);
+            batch.addL(p, factor * Ld / batch.shadow_pdf[k] / batch.shadow_p_RR[k]);
+        }
+    }
+}
@@ -3,18 +3,8 @@
 #include "common.h"
 #include "aabb.h"
 bool aabb::hit(const ray& r, double tmin, double tmax) const{
-    for(int a = 0; a < 3; a++){
-        auto invD = 1.0f / r.direction()[a];
-        auto t0 = (min()[a] - r.origin()[a]) * invD;
-        auto t1 = (max()[a] - r.origin()[a]) * invD;
-        if (invD < 0.0f)  // 处理负向光线
-            std::swap(t0, t1);
-        tmin = t0 > tmin ? t0 : tmin;
-        tmax = t1 < tmax ? t1 : tmax;
-        if(tmax <= tmin)//如果tmax小于tmin，说明光线不会与包围盒相交
-            return false;
-    }
-    return true;
+    const vecf3 dir = r.direction();
+    return hit(r.origin(), vecf3(1.0f / dir.x(), 1.0f / dir.y(), 1.0f / dir.z()), tmin, tmax);
 }
 aabb surrounding_box(const aabb& box0,const aabb& box1){
     pointf3 small(fmin(box0.min().x(),box1.min().x()),
@@ -1,5 +1,23 @@
 #include "aarect.h"
 
+// 由矩形光源上的采样点p填写rec，返回立体角上的pdf: 距离^2 / (cos * 面积)
+static double rect_sample(const pointf3& o, const pointf3& p, const vecf3& outward_normal,
+                          double u, double v, double area, const material* m, hit_record& rec) {
+    vecf3 d = p - o;
+    auto distance_squared = d.length_squared();
+    if (distance_squared == 0)
+        return 0;
+    auto cosine = fabs(dot(d, outward_normal)) / sqrt(distance_squared);
+    if (cosine == 0)
+        return 0;
+    rec.p = p;
+    rec.t = sqrt(distance_squared);
+    rec.u = u;
+    rec.v = v;
+    rec.set_face_normal(ray(o, d), outward_normal);
+    rec.mat_ptr = m;
+    return distance_squared / (cosine * area);
+}
 
 bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     auto t = (k - r.origin().z()) / r.direction().z();//根据纵坐标计算z
@@ -17,11 +35,20 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     // 修正朝向，使得与入射光线方向相反
     // 修改rec的 front_face判定，判断该面是否朝向光线
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
     return true;
 }
 
+bool xy_rect::occluded(const ray& r, double t_min, double t_max) const {
+    auto t = (k - r.origin().z()) / r.direction().z();
+    if (t < t_min || t > t_max || t != t)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
+    return !(x < x0 || x > x1 || y < y0 || y > y1);
+}
+
 bool xy_rect::bounding_box(double time0, double time1, aabb& output_box) const {
     // The bounding box must have non-zero width in each dimension, so pad the Z
     // dimension a small amount.
@@ -30,15 +57,19 @@ bool xy_rect::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 double xy_rect::pdf_value(const pointf3& o, const vecf3& v) const {
-    hit_record rec;
-    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+    // 直接求与平面的交点，不需要填写hit_record
+    auto t = (k - o.z()) / v.z();
+    if (!(t >= 0.001 && t < infinity))
+        return 0;
+    auto x = o.x() + t * v.x();
+    auto y = o.y() + t * v.y();
+    if (x < x0 || x > x1 || y < y0 || y > y1)
         return 0;
 
-    auto area = (x1 - x0) * (y1 - y0);
-    auto distance_squared = rec.t * rec.t * v.length_squared();
-    auto cosine = fabs(dot(v, rec.normal) / v.length());
+    auto distance_squared = t * t * v.length_squared();
+    auto cosine = fabs(v.z()) / v.length();
 
-    return distance_squared / (cosine * area);
+    return distance_squared / (cosine * area());
 }
 
 vecf3 xy_rect::random(const vecf3& o) const {
@@ -46,6 +77,10 @@ vecf3 xy_rect::random(const vecf3& o) const {
     return random_point - o;
 }
 
+double xy_rect::sample(const pointf3& o, const pointd2& u, hit_record& rec) const {
+    return rect_sample(o, pointf3(x0 + u.x() * (x1 - x0), y0 + u.y() * (y1 - y0), k), vecf3(0, 0, 1), u.x(), u.y(), area(), mp.get(), rec);
+}
+
 bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     auto t = (k - r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max|| t != t)
@@ -59,11 +94,20 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vecf3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
     return true;
 }
 
+bool xz_rect::occluded(const ray& r, double t_min, double t_max) const {
+    auto t = (k - r.origin().y()) / r.direction().y();
+    if (t < t_min || t > t_max || t != t)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto z = r.origin().z() + t * r.direction().z();
+    return !(x < x0 || x > x1 || z < z0 || z > z1);
+}
+
 bool xz_rect::bounding_box(double time0, double time1, aabb& output_box) const {
     // The bounding box must have non-zero width in each dimension, so pad the Y
     // dimension a small amount.
@@ -72,15 +116,19 @@ bool xz_rect::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 double xz_rect::pdf_value(const pointf3& o, const vecf3& v) const {
-    hit_record rec;
-    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+    // 直接求与平面的交点，不需要填写hit_record
+    auto t = (k - o.y()) / v.y();
+    if (!(t >= 0.001 && t < infinity))
+        return 0;
+    auto x = o.x() + t * v.x();
+    auto z = o.z() + t * v.z();
+    if (x < x0 || x > x1 || z < z0 || z > z1)
         return 0;
 
-    auto area = (x1 - x0) * (z1 - z0);
-    auto distance_squared = rec.t * rec.t * v.length_squared();
-    auto cosine = fabs(dot(v, rec.normal) / v.length());
+    auto distance_squared = t * t * v.length_squared();
+    auto cosine = fabs(v.y()) / v.length();
 
-    return distance_squared / (cosine * area);
+    return distance_squared / (cosine * area());
 }
 
 vecf3 xz_rect::random(const vecf3& o)const {
@@ -88,6 +136,10 @@ vecf3 xz_rect::random(const vecf3& o)const {
     return random_point - o;
 }
 
+double xz_rect::sample(const pointf3& o, const pointd2& u, hit_record& rec) const {
+    return rect_sample(o, pointf3(x0 + u.x() * (x1 - x0), k, z0 + u.y() * (z1 - z0)), vecf3(0, 1, 0), u.x(), u.y(), area(), mp.get(), rec);
+}
+
 
 bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
     auto t = (k - r.origin().x()) / r.direction().x();
@@ -102,11 +154,20 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     rec.t = t;
     auto outward_normal = vecf3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
+    rec.mat_ptr = mp.get();
     rec.p = r.at(t);
     return true;
 }
 
+bool yz_rect::occluded(const ray& r, double t_min, double t_max) const {
+    auto t = (k - r.origin().x()) / r.direction().x();
+    if (t < t_min || t > t_max || t != t)
+        return false;
+    auto y = r.origin().y() + t * r.direction().y();
+    auto z = r.origin().z() + t * r.direction().z();
+    return !(y < y0 || y > y1 || z < z0 || z > z1);
+}
+
 bool yz_rect::bounding_box(double time0, double time1, aabb& output_box) const {
     // The bounding box must have non-zero width in each dimension, so pad the X
     // dimension a small amount.
@@ -115,19 +176,26 @@ bool yz_rect::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 double yz_rect::pdf_value(const pointf3& o, const vecf3& v) const {
-    hit_record rec;
-    //寻找交点
-    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+    // 直接求与平面的交点，不需要填写hit_record
+    auto t = (k - o.x()) / v.x();
+    if (!(t >= 0.001 && t < infinity))
+        return 0;
+    auto y = o.y() + t * v.y();
+    auto z = o.z() + t * v.z();
+    if (y < y0 || y > y1 || z < z0 || z > z1)
         return 0;
 
-    auto area = (y1 - y0) * (z1 - z0);
-    auto distance_squared = rec.t * rec.t * v.length_squared();
-    auto cosine = fabs(dot(v, rec.normal) / v.length());
+    auto distance_squared = t * t * v.length_squared();
+    auto cosine = fabs(v.x()) / v.length();
 
-    return distance_squared / (cosine * area);
+    return distance_squared / (cosine * area());
 }
 
 vecf3 yz_rect::random(const vecf3& o) const {
     auto random_point = pointf3(k, random_double(y0, y1), random_double(z0, z1));
     return random_point - o;
 }
+
+double yz_rect::sample(const pointf3& o, const pointd2& u, hit_record& rec) const {
+    return rect_sample(o, pointf3(k, y0 + u.x() * (y1 - y0), z0 + u.y() * (z1 - z0)), vecf3(1, 0, 0), u.x(), u.y(), area(), mp.get(), rec);
+}
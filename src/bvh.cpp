@@ -1,81 +1,296 @@
 #include "bvh.h"
+#include <omp.h>
 
+void linear_bvh::build(const std::vector<aabb> &prim_bounds, std::vector<int> &order,
+                       const bvh_build_options &opts) {
+    options = opts;
+    options.max_leaf_size = std::min(std::max(options.max_leaf_size, 1), 65535);
+    options.n_buckets = std::max(options.n_buckets, 2);
+    options.leaf_block_size = std::max(options.leaf_block_size, 1);
+    options.parallel_threshold = std::max(options.parallel_threshold, 2);
+    nodes.clear();
+    order.clear();
+    root_bounds = aabb();
+    if (prim_bounds.empty())
+        return;
+    const int n = static_cast<int>(prim_bounds.size());
+    const bool parallel = options.parallel && n > options.parallel_threshold && omp_get_max_threads() > 1;
+    std::vector<primitive_info> info(n);
+#pragma omp parallel for if(parallel)
+    for (int i = 0; i < n; i++) {
+        info[i].index = i;
+        info[i].bounds = prim_bounds[i];
+        info[i].centroid = (prim_bounds[i].min() + prim_bounds[i].max()) * 0.5f;
+    }
+    std::vector<linear_bvh_node> binary;
+    binary.reserve(2 * info.size());
+    order.reserve(info.size());
+    task_depth = 0;
+    if (parallel) {
+        // 任务数约为线程数的8倍，足以平衡负载，同时减少子树拼接时的复制
+        while ((1 << task_depth) < 8 * omp_get_max_threads() && task_depth < 16)
+            task_depth++;
+#pragma omp parallel
+#pragma omp single nowait
+        build_recursive(info, 0, n, 0, binary, order);
+    } else {
+        build_recursive(info, 0, n, 0, binary, order);
+    }
+    root_bounds = binary[0].bounds;
+    nodes.reserve(binary.size() / 3 + 1);
+    collapse(binary, 0);
+}
+
+int linear_bvh::collapse(const std::vector<linear_bvh_node> &binary, int index) {
+    // 根结点是叶结点时，4叉树只有一个子结点
+    int children[4] = {index, -1, -1, -1};
+    int n = 1;
+    if (binary[index].n_primitives == 0) {
+        children[0] = index + 1;
+        children[1] = binary[index].second_child_offset;
+        n = 2;
+    }
+    while (n < 4) {
+        int best = -1;
+        double best_area = -1;
+        for (int k = 0; k < n; k++) {
+            const linear_bvh_node &c = binary[children[k]];
+            if (c.n_primitives == 0 && c.bounds.surface_area() > best_area) {
+                best_area = c.bounds.surface_area();
+                best = k;
+            }
+        }
+        if (best < 0)
+            break;
+        int expanded = children[best];
+        children[best] = expanded + 1;
+        children[n++] = binary[expanded].second_child_offset;
+    }
+
+    int node_index = static_cast<int>(nodes.size());
+    nodes.emplace_back();
+    int child[4], count[4];
+    for (int k = 0; k < 4; k++) {
+        child[k] = -1;
+        count[k] = 0;
+        if (k >= n)
+            continue;
+        const linear_bvh_node &c = binary[children[k]];
+        if (c.n_primitives > 0) {
+            child[k] = c.primitives_offset;
+            count[k] = c.n_primitives;
+        } else {
+            child[k] = collapse(binary, children[k]);
+        }
+    }
+    // 递归时nodes可能重新分配内存，所以最后再通过下标写入
+    bvh4_node &node = nodes[node_index];
+    for (int k = 0; k < 4; k++) {
+        node.child[k] = child[k];
+        node.count[k] = count[k];
+        for (int a = 0; a < 3; a++) {
+            if (k < n) {
+                node.bounds[0][a][k] = binary[children[k]].bounds.min()[a];
+                node.bounds[1][a][k] = binary[children[k]].bounds.max()[a];
+            } else {
+                node.bounds[0][a][k] = std::numeric_limits<float>::infinity();
+                node.bounds[1][a][k] = -std::numeric_limits<float>::infinity();
+            }
+        }
+    }
+    return node_index;
+}
 
-int partition(std::vector<shared_ptr<hittable>> &objects, int start, int end,const int& axis) {
+// 把单独构建的子树接到out_nodes和out_order的末尾，修正其中的下标
+static void append_subtree(std::vector<linear_bvh_node> &out_nodes, std::vector<int> &out_order,
+                           const std::vector<linear_bvh_node> &sub_nodes, const std::vector<int> &sub_order) {
+    int node_base = static_cast<int>(out_nodes.size());
+    int order_base = static_cast<int>(out_order.size());
+    for (linear_bvh_node node: sub_nodes) {
+        if (node.n_primitives > 0)
+            node.primitives_offset += order_base;
+        else
+            node.second_child_offset += node_base;
+        out_nodes.push_back(node);
+    }
+    out_order.insert(out_order.end(), sub_order.begin(), sub_order.end());
+}
 
-    int idx = random_int(start, end - 1);
+// 按深度优先的顺序直接生成展平的结点，返回当前结点的下标
+int linear_bvh::build_recursive(std::vector<primitive_info> &info, int start, int end, int depth,
+                                std::vector<linear_bvh_node> &out_nodes, std::vector<int> &out_order) const {
+    int node_index = static_cast<int>(out_nodes.size());
+    out_nodes.emplace_back();
 
-    int l = start, r = end - 1;
-    shared_ptr<hittable> pivot = objects[idx];
+    aabb bounds = info[start].bounds;
+    aabb centroid_bounds(info[start].centroid, info[start].centroid);
+    for (int i = start + 1; i < end; i++) {
+        bounds = surrounding_box(bounds, info[i].bounds);
+        centroid_bounds = surrounding_box(centroid_bounds, aabb(info[i].centroid, info[i].centroid));
+    }
 
-    while (l<idx && box_compare(objects[l], pivot, axis))
-        l++;
-    if(l<idx)
-        std::swap(objects[l], objects[idx]);
+    int n = end - start;
+    vecf3 extent = centroid_bounds.max() - centroid_bounds.min();
+    int axis = 0;
+    if (extent.y() > extent.x()) axis = 1;
+    if (extent.z() > extent[axis]) axis = 2;
 
-    while (l < r) {
-        while (l < r && !box_compare(objects[r], pivot, axis))r--;
-        if (l < r) {
-            std::swap(objects[l], objects[r]);
-            l++;
-        }
-        while (l < r && box_compare(objects[l], pivot, axis))l++;
-        if (l < r) {
-            std::swap(objects[l], objects[r]);
-            r--;
+    int mid = -1;
+    if (n > 1) {
+        // 遍历栈的深度有限，树太深时改用中位数划分
+        if (options.split_method == bvh_split_method::SAH && depth < 32 && extent[axis] > 0)
+            mid = split_sah(info, start, end, axis, bounds, centroid_bounds);
+        else if (n > options.max_leaf_size)
+            mid = split_median(info, start, end, axis);
+        if (mid < 0 && n > options.max_leaf_size)
+            mid = split_median(info, start, end, axis);
+    }
+
+    if (mid < 0) {
+        linear_bvh_node &node = out_nodes[node_index];
+        node.bounds = bounds;
+        node.primitives_offset = static_cast<int>(out_order.size());
+        node.n_primitives = static_cast<uint16_t>(n);
+        node.axis = 0;
+        for (int i = start; i < end; i++)
+            out_order.push_back(info[i].index);
+        return node_index;
+    }
+
+    int second_child;
+    if (options.parallel && n > options.parallel_threshold && depth < task_depth) {
+        // 左右子树分别在自己的数组中构建，它们只会访问info中互不相交的两段
+        std::vector<linear_bvh_node> left_nodes, right_nodes;
+        std::vector<int> left_order, right_order;
+#pragma omp task default(shared)
+        build_recursive(info, start, mid, depth + 1, left_nodes, left_order);
+#pragma omp task default(shared)
+        build_recursive(info, mid, end, depth + 1, right_nodes, right_order);
+#pragma omp taskwait
+        append_subtree(out_nodes, out_order, left_nodes, left_order);
+        second_child = static_cast<int>(out_nodes.size());
+        append_subtree(out_nodes, out_order, right_nodes, right_order);
+    } else {
+        build_recursive(info, start, mid, depth + 1, out_nodes, out_order);
+        second_child = build_recursive(info, mid, end, depth + 1, out_nodes, out_order);
+    }
+    // 递归时out_nodes可能重新分配内存，所以最后再通过下标写入
+    linear_bvh_node &node = out_nodes[node_index];
+    node.bounds = bounds;
+    node.second_child_offset = second_child;
+    node.n_primitives = 0;
+    node.axis = static_cast<uint8_t>(axis);
+    return node_index;
+}
+
+int linear_bvh::split_median(std::vector<primitive_info> &info, int start, int end, int axis) const {
+    int mid = start + (end - start) / 2;
+    // 中心相同时按下标排序，保证结果与std::nth_element的实现无关
+    std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+                     [axis](const primitive_info &a, const primitive_info &b) {
+                         if (a.centroid[axis] != b.centroid[axis])
+                             return a.centroid[axis] < b.centroid[axis];
+                         return a.index < b.index;
+                     });
+    return mid;
+}
+
+/*  split_sah: 分桶的表面积启发式
+
+    把包围盒中心沿axis轴均匀地分到n_buckets个桶中，在桶的边界处划分，
+    代价 = traversal_cost + (N_A*S_A + N_B*S_B) / S，其中S为表面积，选择代价最小的划分。
+    leaf_block_size > 1 时 N 为块数 ceil(N/leaf_block_size)，不满的块与满的块代价相同。
+*/
+int linear_bvh::split_sah(std::vector<primitive_info> &info, int start, int end, int axis,
+                          const aabb &bounds, const aabb &centroid_bounds) const {
+    struct bucket_info {
+        int count = 0;
+        aabb bounds;
+    };
+    const int n_buckets = options.n_buckets;
+    const double c_min = centroid_bounds.min()[axis];
+    const double c_extent = centroid_bounds.max()[axis] - c_min;
+    auto bucket_of = [&](const primitive_info &p) {
+        int b = static_cast<int>(n_buckets * ((p.centroid[axis] - c_min) / c_extent));
+        return std::min(std::max(b, 0), n_buckets - 1);
+    };
+
+    std::vector<bucket_info> buckets(n_buckets);
+    for (int i = start; i < end; i++) {
+        bucket_info &b = buckets[bucket_of(info[i])];
+        b.bounds = b.count == 0 ? info[i].bounds : surrounding_box(b.bounds, info[i].bounds);
+        b.count++;
+    }
+
+    // 从右往左扫描一遍得到右侧的包围盒，再从左往右计算每个划分的代价
+    std::vector<double> right_area(n_buckets, 0.0);
+    std::vector<int> right_count(n_buckets, 0);
+    aabb acc;
+    int count = 0;
+    for (int k = n_buckets - 1; k > 0; k--) {
+        if (buckets[k].count > 0) {
+            acc = count == 0 ? buckets[k].bounds : surrounding_box(acc, buckets[k].bounds);
+            count += buckets[k].count;
         }
+        right_area[k] = count > 0 ? acc.surface_area() : 0.0;
+        right_count[k] = count;
     }
-    objects[l] = pivot;
-    return l;
-}
-int getMidNumber(std::vector<shared_ptr<hittable>> &objects, int start, int end, int pos,const int& axis){
-    while (true){
-        int index = partition(objects, start, end, axis); // 获得基准数的位置
-        if (index == pos){
-            return index;
-        }else if (index > pos){ // 只需要在[l, index-1]区间内找pos位置即可
-            end = index;
-        }else { // 只需要在[index, r]区间内找pos位置即可
-            start = index + 1;
+
+    const int block = options.leaf_block_size;
+    auto blocks = [block](int c) { return (c + block - 1) / block; };
+    double min_cost = infinity;
+    int min_bucket = -1;
+    count = 0;
+    for (int k = 0; k < n_buckets - 1; k++) {
+        if (buckets[k].count > 0) {
+            acc = count == 0 ? buckets[k].bounds : surrounding_box(acc, buckets[k].bounds);
+            count += buckets[k].count;
+        }
+        if (count == 0 || right_count[k + 1] == 0)
+            continue;
+        double cost = blocks(count) * acc.surface_area() + blocks(right_count[k + 1]) * right_area[k + 1];
+        if (cost < min_cost) {
+            min_cost = cost;
+            min_bucket = k;
         }
     }
-    return -1; // 一般程序不会到这里
+    if (min_bucket < 0)
+        return -1;
+
+    int n = end - start;
+    double area = bounds.surface_area();
+    min_cost = options.traversal_cost + (area > 0 ? min_cost / area : blocks(n));
+    if (n <= options.max_leaf_size && min_cost >= blocks(n))
+        return -1;
+
+    auto it = std::partition(info.begin() + start, info.begin() + end,
+                             [&](const primitive_info &p) { return bucket_of(p) <= min_bucket; });
+    int mid = static_cast<int>(it - info.begin());
+    if (mid == start || mid == end)
+        return -1;
+    return mid;
 }
 
 bvh_node::bvh_node(
         std::vector<shared_ptr<hittable>> &src_objects,
-        size_t start, size_t end, double time0, double time1) {
-    //创建一个副本，对副本进行操作，不改变原始数据
-    int axis = random_int(0, 2);//随机选择的一个轴来进行排序
-    //比较函数器！
-    auto comparator = (axis == 0) ? box_x_compare
-                                  : (axis == 1) ? box_y_compare
-                                                : box_z_compare;
-    size_t object_span = end - start;
-    if (object_span == 1) {//如果只有一个物体，将复制一份，避免空节点
-        left = right = src_objects[start];
-    } else if (object_span == 2) {//如果只有两个物体，直接比较
-        if (comparator(src_objects[start], src_objects[start + 1])) {
-            left = src_objects[start];
-            right = src_objects[start + 1];
-        } else {
-            left = src_objects[start + 1];
-            right = src_objects[start];
-        }
-    } else {//如果有多个物体，将物体按照axis轴排序，然后取中间的物体作为分割点
-
-        //O(n)
-        int mid = getMidNumber(src_objects, start, end, start + object_span / 2, axis);
-//        std::sort(src_objects.begin() + start, src_objects.begin() + end, comparator);//时间复杂度为O(nlogn)
-//        auto mid = start + object_span / 2;//中位数
-        left = make_shared<bvh_node>(src_objects, start, mid, time0, time1);//将排序好的Objs再次进行递归
-        right = make_shared<bvh_node>(src_objects, mid, end, time0, time1);
+        size_t start, size_t end, double time0, double time1, const bvh_build_options &options) {
+    const int n = static_cast<int>(end - start);
+    std::vector<aabb> prim_bounds(n);
+    bool missing_box = false;
+#pragma omp parallel for if(options.parallel && n > options.parallel_threshold) reduction(||:missing_box)
+    for (int i = 0; i < n; i++) {
+        if (!src_objects[start + i]->bounding_box(time0, time1, prim_bounds[i]))
+            missing_box = true;
     }
-    aabb box_left, box_right;
-    if (!left->bounding_box(time0, time1, box_left) || !right->bounding_box(time0, time1, box_right)) {
+    if (missing_box)
         std::cerr << "No bounding box in bvh_node constructor.\n";
-    }
-    box = surrounding_box(box_left, box_right);
+
+    std::vector<int> order;
+    bvh.build(prim_bounds, order, options);
+    primitives.reserve(order.size());
+    for (int index : order)
+        primitives.push_back(src_objects[start + index]);
+    box = bvh.bounds();
 }
 
 bool bvh_node::bounding_box(double time0, double time1, aabb &output_box) const {
@@ -83,12 +298,131 @@ bool bvh_node::bounding_box(double time0, double time1, aabb &output_box) const
     return true;
 }
 
-//判断光线是否与当前结点的包围盒相交，如果相交，再判断是否与左右子树相交，直到叶子结点
 bool bvh_node::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    // 中序遍历
-    //如果当前结点的包围盒没有被击中，直接返回false,避免无效的搜索
-    if (!box.hit(r, t_min, t_max)) return false;
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
-    return hit_left || hit_right;
+    return bvh.traverse(r, t_min, t_max, [&](int first, int count, double &closest) {
+        bool hit_anything = false;
+        for (int i = first; i < first + count; i++) {
+            if (primitives[i]->hit(r, t_min, closest, rec)) {
+                hit_anything = true;
+                closest = rec.t;
+            }
+        }
+        return hit_anything;
+    });
+}
+
+bool bvh_node::occluded(const ray &r, double t_min, double t_max) const {
+    return bvh.any_hit(r, t_min, t_max, [&](int first, int count) {
+        for (int i = first; i < first + count; i++) {
+            if (primitives[i]->occluded(r, t_min, t_max))
+                return true;
+        }
+        return false;
+    });
+}
+
+uint32_t bvh_node::hit_packet(const ray *r, uint32_t rays, double t_min, double *t_max, hit_record *recs,
+                              pcg32 *rngs) const {
+    uint32_t hits = 0;
+    bvh.traverse_packet(r, rays, t_min, t_max, [&](int first, int count, uint32_t m) {
+        uint32_t found = 0;
+        for (int i = first; i < first + count; i++)
+            found |= primitives[i]->hit_packet(r, m, t_min, t_max, recs, rngs);
+        hits |= found;
+        return found;
+    });
+    return hits;
+}
+
+uint32_t bvh_node::occluded_packet(const ray *r, uint32_t rays, double t_min, const double *t_max,
+                                   pcg32 *rngs) const {
+    return bvh.any_hit_packet(r, rays, t_min, t_max, [&](int first, int count, uint32_t m) {
+        uint32_t blocked = 0;
+        for (int i = first; i < first + count && m; i++) {
+            uint32_t b = primitives[i]->occluded_packet(r, m, t_min, t_max, rngs);
+            blocked |= b;
+            m &= ~b;
+        }
+        return blocked;
+    });
+}
+
+top_level_bvh::top_level_bvh(const hittable_list &world, double time0, double time1, const bvh_build_options &options) {
+    const auto &objects = world.objects;
+    std::vector<aabb> boxes(objects.size());
+    std::vector<bool> has_box(objects.size());
+    for (size_t i = 0; i < objects.size(); i++)
+        has_box[i] = objects[i]->bounding_box(time0, time1, boxes[i]);
+
+    // 所有物体包围盒的并集
+    aabb scene_box;
+    bool first_box = true;
+    for (size_t i = 0; i < objects.size(); i++) {
+        if (!has_box[i]) continue;
+        scene_box = first_box ? boxes[i] : surrounding_box(scene_box, boxes[i]);
+        first_box = false;
+    }
+
+    std::vector<shared_ptr<hittable>> bounded;
+    for (size_t i = 0; i < objects.size(); i++) {
+        bool encloses_scene = has_box[i] && objects.size() > 1 &&
+                              boxes[i].min().x() <= scene_box.min().x() && boxes[i].max().x() >= scene_box.max().x() &&
+                              boxes[i].min().y() <= scene_box.min().y() && boxes[i].max().y() >= scene_box.max().y() &&
+                              boxes[i].min().z() <= scene_box.min().z() && boxes[i].max().z() >= scene_box.max().z();
+        if (!has_box[i] || encloses_scene)
+            unbounded.add(objects[i]);
+        else
+            bounded.push_back(objects[i]);
+    }
+    if (!bounded.empty())
+        bvh = make_shared<bvh_node>(bounded, 0, bounded.size(), time0, time1, options);
+}
+
+bool top_level_bvh::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    bool hit_anything = false;
+    if (bvh && bvh->hit(r, t_min, t_max, rec)) {
+        hit_anything = true;
+        t_max = rec.t;
+    }
+    for (const auto &object: unbounded.objects) {
+        if (object->hit(r, t_min, t_max, rec)) {
+            hit_anything = true;
+            t_max = rec.t;
+        }
+    }
+    return hit_anything;
+}
+
+bool top_level_bvh::occluded(const ray &r, double t_min, double t_max) const {
+    if (bvh && bvh->occluded(r, t_min, t_max))
+        return true;
+    return unbounded.occluded(r, t_min, t_max);
+}
+
+uint32_t top_level_bvh::hit_packet(const ray *r, uint32_t rays, double t_min, double *t_max, hit_record *recs,
+                                   pcg32 *rngs) const {
+    uint32_t hits = bvh ? bvh->hit_packet(r, rays, t_min, t_max, recs, rngs) : 0;
+    for (const auto &object: unbounded.objects)
+        hits |= object->hit_packet(r, rays, t_min, t_max, recs, rngs);
+    return hits;
+}
+
+uint32_t top_level_bvh::occluded_packet(const ray *r, uint32_t rays, double t_min, const double *t_max,
+                                        pcg32 *rngs) const {
+    uint32_t blocked = bvh ? bvh->occluded_packet(r, rays, t_min, t_max, rngs) : 0;
+    rays &= ~blocked;
+    if (rays && !unbounded.objects.empty())
+        blocked |= unbounded.occluded_packet(r, rays, t_min, t_max, rngs);
+    return blocked;
+}
+
+bool top_level_bvh::bounding_box(double time0, double time1, aabb &output_box) const {
+    if (!unbounded.objects.empty() && !unbounded.bounding_box(time0, time1, output_box))
+        return false;
+    if (bvh) {
+        aabb box;
+        bvh->bounding_box(time0, time1, box);
+        output_box = unbounded.objects.empty() ? box : surrounding_box(output_box, box);
+    }
+    return bvh || !unbounded.objects.empty();
 }
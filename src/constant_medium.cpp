@@ -59,8 +59,8 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
     rec.normal = vecf3(1, 0, 0);  // arbitrary
     rec.front_face = true;       // also arbitrary
-    rec.mat_ptr = phase_function;
-    rec.boundary_ptr = boundary;
+    rec.mat_ptr = phase_function.get();
+    rec.boundary_ptr = boundary.get();
     rec.density = -1/neg_inv_density;
     return true;
 }
\ No newline at end of file
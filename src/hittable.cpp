@@ -1,111 +1,87 @@
 #include "hittable.h"
 
-//平移
-bool translate::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    //物体的平移相当于光线的反方向平移
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
-    if (!ptr->hit(moved_r, t_min, t_max, rec))
-        return false;
-    rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
-
-    return true;
-}
-
-bool translate::bounding_box(double time0, double time1, aabb &output_box) const {
-    //调用时才计算包围盒
-    if (!ptr->bounding_box(time0, time1, output_box))
-        return false;
-    //包围盒平移
-    output_box = aabb(
-            output_box.min() + offset,
-            output_box.max() + offset);
-
-    return true;
-}
-
-//旋转
-rotate::rotate(shared_ptr<hittable> p, double angle, Axis axis)
-        : ptr(p), axis(axis) {
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    hasbox = ptr->bounding_box(0, 1, bbox);
-
-    pointf3 min(infinity, infinity, infinity);
-    pointf3 max(-infinity, -infinity, -infinity);
-
-    for (int i = 0; i < 2; i++) {
-        for (int j = 0; j < 2; j++) {
-            for (int k = 0; k < 2; k++) {
-                vecf3 tester(
-                        i * bbox.max().x() + (1 - i) * bbox.min().x(),
-                        j * bbox.max().y() + (1 - j) * bbox.min().y(),
-                        k * bbox.max().z() + (1 - k) * bbox.min().z());
-
-                for (size_t c = 0; c < 3; ++c) {
-                    if (c == static_cast<size_t>(axis)) {
-                        auto c1 = (c + 1) % 3;
-                        auto c2 = (c + 2) % 3;
-                        float tmp1 = tester[c1];
-                        float tmp2 = tester[c2];
-                        tester[c1] = cos_theta * tmp1 - sin_theta * tmp2;
-                        tester[c2] = sin_theta * tmp1 + cos_theta * tmp2;
-                    }
-                }
-
-                for (int c = 0; c < 3; c++) {
-                    min[c] = fmin(min[c], tester[c]);
-                    max[c] = fmax(max[c], tester[c]);
-                }
-            }
+uint32_t hittable::hit_packet(const ray *r, uint32_t rays, double t_min, double *t_max, hit_record *recs,
+                              pcg32 *rngs) const {
+    uint32_t hits = 0;
+    for (; rays; rays &= rays - 1) {
+        int i = lowest_set_bit(rays);
+        if (rngs)
+            std::swap(thread_rng(), rngs[i]);
+        if (hit(r[i], t_min, t_max[i], recs[i])) {
+            t_max[i] = recs[i].t;
+            hits |= 1u << i;
         }
+        if (rngs)
+            std::swap(thread_rng(), rngs[i]);
     }
-
-    bbox = aabb(min, max);
+    return hits;
 }
 
-bool rotate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    for (size_t c = 0; c < 3; ++c) {
-        if (c == static_cast<size_t>(axis)) {
-            auto c1 = (c + 1) % 3;
-            auto c2 = (c + 2) % 3;
-            origin[c1] = cos_theta * r.origin()[c1] + sin_theta * r.origin()[c2];
-            origin[c2] = -sin_theta * r.origin()[c1] + cos_theta * r.origin()[c2];
-
-            direction[c1] = cos_theta * r.direction()[c1] + sin_theta * r.direction()[c2];
-            direction[c2] = -sin_theta * r.direction()[c1] + cos_theta * r.direction()[c2];
-        }
+uint32_t hittable::occluded_packet(const ray *r, uint32_t rays, double t_min, const double *t_max,
+                                   pcg32 *rngs) const {
+    uint32_t blocked = 0;
+    for (; rays; rays &= rays - 1) {
+        int i = lowest_set_bit(rays);
+        if (rngs)
+            std::swap(thread_rng(), rngs[i]);
+        if (occluded(r[i], t_min, t_max[i]))
+            blocked |= 1u << i;
+        if (rngs)
+            std::swap(thread_rng(), rngs[i]);
     }
+    return blocked;
+}
 
-    ray rotated_r(origin, direction, r.time());
+transform::transform(shared_ptr<hittable> p, const affine3 &object_to_world) : ptr(p), to_world(object_to_world) {
+    // 合并嵌套的变换：外层矩阵乘以内层矩阵，直接引用内层包装的物体
+    auto inner = std::dynamic_pointer_cast<transform>(ptr);
+    if (inner && inner->can_collapse()) {
+        to_world = to_world * inner->to_world;
+        ptr = inner->ptr;
+    }
+    to_object = to_world.inverse();
+    aabb object_box;
+    has_box = ptr->bounding_box(0, 1, object_box);
+    if (has_box)
+        box = to_world.box(object_box);
+}
 
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
+bool transform::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    if (!ptr->hit(to_object_ray(r), t_min, t_max, rec))
         return false;
+    // 法向量已经朝向光线的反方向，按L^-T变换后与世界空间中光线的点积符号不变，front_face保持不变
+    rec.p = to_world.point(rec.p);
+    rec.normal = unit_vector(affine3::transform_normal(to_object, rec.normal));
+    return true;
+}
 
-    auto p = rec.p;
-    auto normal = rec.normal;
-
-    for (size_t c = 0; c < 3; ++c) {
-        if (c == static_cast<size_t>(axis)) {
-            auto c1 = (c + 1) % 3;
-            auto c2 = (c + 2) % 3;
-            p[c1] = cos_theta * rec.p[c1] - sin_theta * rec.p[c2];
-            p[c2] = sin_theta * rec.p[c1] + cos_theta * rec.p[c2];
-
-            normal[c1] = cos_theta * rec.normal[c1] - sin_theta * rec.normal[c2];
-            normal[c2] = sin_theta * rec.normal[c1] + cos_theta * rec.normal[c2];
-        }
-    }
+double transform::pdf_value(const pointf3 &o, const vecf3 &v) const {
+    // 世界空间中的单位方向w对应物体空间中的方向L^-1*w，dw' = |det L^-1| / |L^-1*w|^3 dw
+    const vecf3 w = unit_vector(v);
+    const vecf3 w_object = to_object.vector(w);
+    const double len = w_object.length();
+    if (len == 0)
+        return 0;
+    return ptr->pdf_value(to_object.point(o), w_object) * fabs(to_object.determinant()) / (len * len * len);
+}
 
-    rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
+vecf3 transform::random(const vecf3 &o) const {
+    return to_world.vector(ptr->random(to_object.point(o)));
+}
 
-    return true;
+double transform::sample(const pointf3 &o, const pointd2 &u, hit_record &rec) const {
+    double pdf = ptr->sample(to_object.point(o), u, rec);
+    if (pdf == 0)
+        return 0;
+    rec.p = to_world.point(rec.p);
+    rec.normal = unit_vector(affine3::transform_normal(to_object, rec.normal));
+    // 与pdf_value相同的雅可比行列式
+    const vecf3 d = rec.p - o;
+    rec.t = d.length();
+    const double len = to_object.vector(d / rec.t).length();
+    return pdf * fabs(to_object.determinant()) / (len * len * len);
 }
+
 //翻转：改变材料的内外朝向，最直接的应用是对于无限大平面，可以通过翻转法向量来改变平面的朝向
 bool flip_face::hit(
         const ray &r,
@@ -1,19 +1,26 @@
 #include "hittable_list.h"
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
+    //物体只在找到更近的交点时才会修改rec，所以可以直接写入rec，不需要临时的记录
     bool hit_anything = false;
     double closest_so_far = t_max;
 
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
     return hit_anything;
 }
 
+bool hittable_list::occluded(const ray& r, double t_min, double t_max) const {
+    for (const auto& object : objects) {
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+    return false;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb&ouput_box)const{
     //总包围盒:根结点
     if(objects.empty()) return false;
@@ -44,4 +51,11 @@ vecf3 hittable_list::random(const vecf3 &o) const {
        vecf3 rand_dir = objects[random_int(0, int_size - 1)]->random(o);
        if(rand_dir.length()!=0) return rand_dir;
     } while (true);
-}
\ No newline at end of file
+}
+
+double hittable_list::area() const {
+    double sum = 0.0;
+    for (const auto& object : objects)
+        sum += object->area();
+    return sum;
+}
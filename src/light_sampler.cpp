@@ -0,0 +1,134 @@
+#include "light_sampler.h"
+#include "material.h"
+#include "color.h"
+
+light_sampler::light_sampler(const hittable_list &light_list) {
+    const auto &objects = light_list.objects;
+    size_t n = objects.size();
+    if (n == 0)
+        return;
+
+    // 估计每个光源的功率，无法估计的记为0，之后用平均值代替
+    std::vector<double> power(n, 0.0);
+    double known_sum = 0;
+    int known = 0;
+    for (size_t i = 0; i < n; i++) {
+        shared_ptr<material> mat;
+        objects[i]->getMaterial(mat);
+        double p = mat ? objects[i]->area() * luminance(mat->average_emitted()) : 0.0;
+        if (p > 0 && std::isfinite(p)) {
+            power[i] = p;
+            known_sum += p;
+            known++;
+        }
+    }
+    double fallback = known ? known_sum / known : 1.0;
+    for (auto &p: power)
+        if (p <= 0)
+            p = fallback;
+
+    // 有包围盒的光源按BVH叶结点的顺序排列
+    std::vector<aabb> boxes;
+    std::vector<int> bounded, unbounded;
+    for (size_t i = 0; i < n; i++) {
+        aabb box;
+        if (objects[i]->bounding_box(0, 1, box)) {
+            boxes.push_back(box);
+            bounded.push_back(static_cast<int>(i));
+        } else {
+            unbounded.push_back(static_cast<int>(i));
+        }
+    }
+    std::vector<int> order;
+    if (!boxes.empty()) {
+        bvh_build_options options;
+        options.parallel = false;
+        bvh.build(boxes, order, options);
+    }
+    std::vector<double> sorted_power;
+    for (int k: order) {
+        lights.push_back(objects[bounded[k]]);
+        sorted_power.push_back(power[bounded[k]]);
+    }
+    num_bounded = static_cast<int>(lights.size());
+    for (int i: unbounded) {
+        lights.push_back(objects[i]);
+        sorted_power.push_back(power[i]);
+    }
+    buildAliasTable(sorted_power);
+}
+
+void light_sampler::buildAliasTable(const std::vector<double> &power) {
+    int n = static_cast<int>(power.size());
+    double total = 0;
+    for (double p: power)
+        total += p;
+    pmf.resize(n);
+    alias_prob.assign(n, 1.0);
+    alias.resize(n);
+    // 概率乘以n后，小于1的格子用大于1的格子补满
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; i++) {
+        pmf[i] = power[i] / total;
+        scaled[i] = pmf[i] * n;
+        alias[i] = i;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        alias_prob[s] = scaled[s];
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // 剩下的格子由于舍入误差只会接近1，直接保留自己
+}
+
+int light_sampler::pick(double u, double &prob) const {
+    int n = static_cast<int>(lights.size());
+    if (n == 0) {
+        prob = 0;
+        return -1;
+    }
+    double x = u * n;
+    int i = std::min(static_cast<int>(x), n - 1);
+    int k = (x - i) < alias_prob[i] ? i : alias[i];
+    prob = pmf[k];
+    return k;
+}
+
+bool light_sampler::sample(const pointf3 &o, double time, double u_pick, const pointd2 &u, light_record &ls) const {
+    if (lights.empty())
+        return false;
+    double prob;
+    hit_record rec;
+    double pdf = lights[pick(u_pick, prob)]->sample(o, u, rec);
+    if (!(pdf > 0) || !rec.mat_ptr || rec.t == 0)
+        return false;
+    ls.p = rec.p;
+    ls.dist = rec.t;
+    ls.dir = (rec.p - o) / rec.t;
+    ls.normal = rec.normal;
+    ls.radiance = rec.mat_ptr->emitted(ray(o, ls.dir, time), rec, rec.u, rec.v, rec.p);
+    ls.pdf = pdf * prob;
+    return true;
+}
+
+double light_sampler::pdf_value(const pointf3 &o, const vecf3 &v) const {
+    double sum = 0.0;
+    if (lights.empty())
+        return sum;
+    bvh.any_hit(ray(o, v), 0.001, infinity, [&](int first, int count) {
+        for (int i = first; i < first + count; i++)
+            sum += pmf[i] * lights[i]->pdf_value(o, v);
+        return false;
+    });
+    for (size_t i = num_bounded; i < lights.size(); i++)
+        sum += pmf[i] * lights[i]->pdf_value(o, v);
+    return sum;
+}
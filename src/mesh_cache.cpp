@@ -0,0 +1,243 @@
+#include "mesh_cache.h"
+#include "mesh_triangle.h"
+#include "mapped_file.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <type_traits>
+
+namespace {
+
+const char rmesh_magic[8] = {'R', 'M', 'E', 'S', 'H', 0, 0, 0};
+// 缓存的布局、建树的算法或者下标的含义改变时增加版本号(2: 省略的纹理和法向量下标记为absent_index)
+const uint32_t rmesh_version = 2;
+const uint32_t rmesh_endian = 0x01020304;
+
+enum rmesh_array {
+    Positions, UVs, Normals, Indices, UVIndices, NormalIndices, Nodes, Blocks, NumArrays
+};
+
+struct rmesh_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t key;
+    uint64_t num;
+    uint64_t counts[NumArrays];
+    float aabb_min[3], aabb_max[3];
+    float root_min[3], root_max[3];
+};
+
+static_assert(std::is_trivially_copyable<pointf3>::value, "pointf3 must be trivially copyable");
+static_assert(std::is_trivially_copyable<texf2>::value, "texf2 must be trivially copyable");
+static_assert(std::is_trivially_copyable<bvh4_node>::value, "bvh4_node must be trivially copyable");
+static_assert(std::is_trivially_copyable<triangle_block4>::value, "triangle_block4 must be trivially copyable");
+
+// 每个数组从16字节对齐的位置开始
+size_t align16(size_t offset) {
+    return (offset + 15) & ~size_t(15);
+}
+
+inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+    h ^= v * 0x9E3779B97F4A7C15ull;
+    h = (h << 31) | (h >> 33);
+    return h * 0xC2B2AE3D27D4EB4Full;
+}
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h) {
+    const char *p = static_cast<const char *>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t v;
+        std::memcpy(&v, p + i, 8);
+        h = hash_mix(h, v);
+    }
+    uint64_t tail = 0;
+    if (size > i) // 空文件时data可能是nullptr
+        std::memcpy(&tail, p + i, size - i);
+    h = hash_mix(h, tail);
+    return hash_mix(h, size);
+}
+
+template<typename T>
+bool read_array(const char *base, size_t file_size, size_t &offset, uint64_t count, std::vector<T> &out) {
+    offset = align16(offset);
+    if (count > (file_size - std::min(offset, file_size)) / sizeof(T))
+        return false;
+    out.resize(count);
+    if (count > 0)
+        std::memcpy(out.data(), base + offset, count * sizeof(T));
+    offset += count * sizeof(T);
+    return true;
+}
+
+template<typename T>
+void write_array(std::ofstream &out, size_t &offset, const std::vector<T> &data) {
+    static const char zeros[16] = {};
+    size_t aligned = align16(offset);
+    out.write(zeros, aligned - offset);
+    out.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(T));
+    offset = aligned + data.size() * sizeof(T);
+}
+
+// 下标都在[0, count)中；allow_absent为true时也可以是absent_index
+bool indices_in_range(const std::vector<int> &indices, size_t count, bool allow_absent) {
+    for (int i: indices) {
+        if ((i < 0 || static_cast<size_t>(i) >= count) && !(allow_absent && i == absent_index))
+            return false;
+    }
+    return true;
+}
+
+// 结点必须构成一棵树：内部结点的子结点下标比自己大且只被引用一次，叶结点的三角形块和块中的三角形下标都在范围内
+bool bvh_in_range(const std::vector<bvh4_node> &nodes, const std::vector<triangle_block4> &blocks, size_t num) {
+    std::vector<char> referenced(nodes.size(), 0);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const bvh4_node &node = nodes[i];
+        for (int k = 0; k < 4; k++) {
+            int child = node.child[k], count = node.count[k];
+            if (count < 0)
+                return false;
+            if (child == -1) {
+                // 空位只靠空的包围盒跳过
+                if (count != 0 || !(node.bounds[0][0][k] > node.bounds[1][0][k]))
+                    return false;
+            } else if (count == 0) {
+                if (child <= static_cast<int>(i) || static_cast<size_t>(child) >= nodes.size() || referenced[child])
+                    return false;
+                referenced[child] = 1;
+            } else if (child < 0 || static_cast<size_t>(child) + count > blocks.size()) {
+                return false;
+            }
+        }
+    }
+    for (const triangle_block4 &block: blocks) {
+        for (int id: block.ids) {
+            if (id < -1 || (id >= 0 && static_cast<size_t>(id) >= num))
+                return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+uint64_t mesh_cache_key(const char *obj_data, size_t obj_size, int scale, const bvh_build_options &options) {
+    uint64_t h = hash_bytes(obj_data, obj_size, rmesh_version);
+    h = hash_mix(h, static_cast<uint64_t>(scale));
+    h = hash_mix(h, static_cast<uint64_t>(options.split_method));
+    h = hash_mix(h, static_cast<uint64_t>(options.max_leaf_size));
+    h = hash_mix(h, static_cast<uint64_t>(options.n_buckets));
+    h = hash_mix(h, static_cast<uint64_t>(options.leaf_block_size));
+    uint64_t cost;
+    std::memcpy(&cost, &options.traversal_cost, sizeof(cost));
+    h = hash_mix(h, cost);
+    h = hash_mix(h, sizeof(bvh4_node) << 16 | sizeof(triangle_block4));
+    return h;
+}
+
+std::string mesh_cache_path(const std::string &obj_filename) {
+    size_t slash = obj_filename.find_last_of("/\\");
+    size_t dot = obj_filename.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return obj_filename + ".rmesh";
+    return obj_filename.substr(0, dot) + ".rmesh";
+}
+
+bool mesh_triangle::loadCache(const std::string &path, uint64_t key) {
+    mapped_file file;
+    if (!file.open(path) || file.size() < sizeof(rmesh_header))
+        return false;
+    rmesh_header header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, rmesh_magic, sizeof(rmesh_magic)) != 0 || header.version != rmesh_version ||
+        header.endian != rmesh_endian || header.key != key)
+        return false;
+
+    mesh_data data;
+    std::vector<bvh4_node> nodes;
+    std::vector<triangle_block4> tri_blocks;
+    const char *base = file.data();
+    size_t offset = sizeof(header);
+    bool ok = read_array(base, file.size(), offset, header.counts[Positions], data.positions) &&
+              read_array(base, file.size(), offset, header.counts[UVs], data.uvs) &&
+              read_array(base, file.size(), offset, header.counts[Normals], data.normals) &&
+              read_array(base, file.size(), offset, header.counts[Indices], data.indices) &&
+              read_array(base, file.size(), offset, header.counts[UVIndices], data.uv_indices) &&
+              read_array(base, file.size(), offset, header.counts[NormalIndices], data.normal_indices) &&
+              read_array(base, file.size(), offset, header.counts[Nodes], nodes) &&
+              read_array(base, file.size(), offset, header.counts[Blocks], tri_blocks);
+    if (!ok || data.indices.size() != 3 * header.num)
+        return false;
+    // key一致但文件损坏时重新解析OBJ，而不是越界访问
+    if (!indices_in_range(data.indices, data.positions.size(), false) ||
+        (!data.uv_indices.empty() && (data.uv_indices.size() != data.indices.size() ||
+                                      !indices_in_range(data.uv_indices, data.uvs.size(), true))) ||
+        (!data.normal_indices.empty() && (data.normal_indices.size() != data.indices.size() ||
+                                          !indices_in_range(data.normal_indices, data.normals.size(), true))) ||
+        !bvh_in_range(nodes, tri_blocks, header.num))
+        return false;
+
+    num = header.num;
+    aabb_min = pointf3(header.aabb_min[0], header.aabb_min[1], header.aabb_min[2]);
+    aabb_max = pointf3(header.aabb_max[0], header.aabb_max[1], header.aabb_max[2]);
+    mesh = std::move(data);
+    bvh.assign(std::move(nodes), aabb(pointf3(header.root_min[0], header.root_min[1], header.root_min[2]),
+                                      pointf3(header.root_max[0], header.root_max[1], header.root_max[2])));
+    blocks = std::move(tri_blocks);
+    return true;
+}
+
+bool mesh_triangle::saveCache(const std::string &path, uint64_t key) const {
+    rmesh_header header{};
+    std::memcpy(header.magic, rmesh_magic, sizeof(rmesh_magic));
+    header.version = rmesh_version;
+    header.endian = rmesh_endian;
+    header.key = key;
+    header.num = num;
+    header.counts[Positions] = mesh.positions.size();
+    header.counts[UVs] = mesh.uvs.size();
+    header.counts[Normals] = mesh.normals.size();
+    header.counts[Indices] = mesh.indices.size();
+    header.counts[UVIndices] = mesh.uv_indices.size();
+    header.counts[NormalIndices] = mesh.normal_indices.size();
+    header.counts[Nodes] = bvh.nodes.size();
+    header.counts[Blocks] = blocks.size();
+    aabb root = bvh.bounds();
+    for (int a = 0; a < 3; a++) {
+        header.aabb_min[a] = aabb_min[a];
+        header.aabb_max[a] = aabb_max[a];
+        header.root_min[a] = root.min()[a];
+        header.root_max[a] = root.max()[a];
+    }
+
+    // 先写入临时文件再改名，避免其他进程读到写了一半的缓存
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out)
+            return false;
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        size_t offset = sizeof(header);
+        write_array(out, offset, mesh.positions);
+        write_array(out, offset, mesh.uvs);
+        write_array(out, offset, mesh.normals);
+        write_array(out, offset, mesh.indices);
+        write_array(out, offset, mesh.uv_indices);
+        write_array(out, offset, mesh.normal_indices);
+        write_array(out, offset, bvh.nodes);
+        write_array(out, offset, blocks);
+        if (!out) {
+            out.close();
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    // Windows下rename不能覆盖已有的文件
+    std::remove(path.c_str());
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
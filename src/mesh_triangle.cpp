@@ -2,37 +2,66 @@
 // Created by Runze on 01/07/2023.
 //
 #include "mesh_triangle.h"
+#include "mesh_cache.h"
+#include "mapped_file.h"
 #include <chrono>
-mesh_triangle::mesh_triangle(const std::vector<pointf3> &vertices, const std::vector<int>& faces,shared_ptr<material> m) {
-    Init(vertices,faces,m);
+
+mesh_triangle::mesh_triangle(const std::vector<pointf3> &vertices, const std::vector<int>& faces,shared_ptr<material> m,
+                             const bvh_build_options& options) {
+    mesh.positions = vertices;
+    mesh.indices = faces;
+    mat_ptr = m;
+    Init(options);
+}
+
+mesh_triangle::mesh_triangle(mesh_data data, shared_ptr<material> m, const bvh_build_options &options) {
+    mesh = std::move(data);
+    mat_ptr = m;
+    Init(options);
 }
-mesh_triangle::mesh_triangle(const std::string& filename, shared_ptr<material> m,int scale) {
-    ModelImporter model;
+
+mesh_triangle::mesh_triangle(const std::string& filename, shared_ptr<material> m,int scale,
+                             const bvh_build_options& options, const mesh_load_options& load_options) {
+    mat_ptr = m;
+    mapped_file obj;
+    if (!obj.open(filename)) {
+        std::cerr << "Error opening file: " << filename << std::endl;
+        exit(1);
+    }
+    uint64_t key = 0;
+    std::string cache_path;
+    if (load_options.use_cache) {
+        key = mesh_cache_key(obj.data(), obj.size(), scale, options);
+        cache_path = mesh_cache_path(filename);
+        if (loadCache(cache_path, key))
+            return;
+    }
+
     auto start_time = std::chrono::high_resolution_clock::now();
-    model.parseOBJ(filename.c_str());
+    if (!parse_obj(obj.data(), obj.size(), mesh, filename))
+        exit(1);
+    obj.close();
     auto end_time = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed_seconds = end_time - start_time;
     if (elapsed_seconds.count() > 0.75)
         std::cout << "Loading " << filename << " takes " << elapsed_seconds.count() << " seconds" << std::endl;
-    std::vector<pointf3> vertices;
-    std::vector<float> vertices_f;
-//    std::vector<texf2> texCoords;
-//    std::vector<int> stInds;
-
-    std::vector<int> vertInds;
-    model.getVertexIndices(vertInds);
-
-     std::vector<float> triangle_vertices_f;
-     std::vector<float> triangle_texCoord_f;
-    model.getVertexVals(vertices_f);
-    vertices.reserve(vertices_f.size() / 3);
-    for (int i = 0; i < vertices_f.size(); i += 3) {
-        vertices.emplace_back(vertices_f[i] * scale, vertices_f[i + 1] * scale, vertices_f[i + 2] * scale);
+    if (scale != 1)
+        for (auto &vertex: mesh.positions)
+            vertex = vertex * float(scale);
+    Init(options);
+    if (load_options.use_cache && !saveCache(cache_path, key))
+        std::cerr << "Warning: cannot write mesh cache " << cache_path << std::endl;
+}
+
+void mesh_triangle::Init(const bvh_build_options& options){
+    num = mesh.numTriangles();
+    if (mesh.positions.empty() || num == 0) {
+        aabb_min = aabb_max = pointf3(0, 0, 0);
+        return;
     }
-//    Init(vertices,vertInds,m);
-    this->aabb_min = vertices[0];
-    this->aabb_max = vertices[0];
-    for (auto vertice : vertices) {
+    this->aabb_min = mesh.positions[0];
+    this->aabb_max = mesh.positions[0];
+    for (auto vertice : mesh.positions) {
         if(vertice.x() < aabb_min.x()) aabb_min.e[0] = vertice.x();
         if(vertice.y() < aabb_min.y()) aabb_min.e[1] = vertice.y();
         if(vertice.z() < aabb_min.z()) aabb_min.e[2] = vertice.z();
@@ -40,86 +69,231 @@ mesh_triangle::mesh_triangle(const std::string& filename, shared_ptr<material> m
         if(vertice.y() > aabb_max.y()) aabb_max.e[1] = vertice.y();
         if(vertice.z() > aabb_max.z()) aabb_max.e[2] = vertice.z();
     }
+
     pointf3 mean_point = (aabb_min + aabb_max) / 2;
     aabb_min = aabb_min - mean_point;
     aabb_max = aabb_max - mean_point;
-    num = model.getNumTriangles();
-    model.getTriangleVertices(triangle_vertices_f);
-    model.getTriangleTexCoords(triangle_texCoord_f);
-    if(!model.is_texture){
-        for(int i=0;i<num;i++){
-            std::vector<pointf3> triangle_vertices(3);
-            for(int j=0;j<3;j++){
-                triangle_vertices[j] = pointf3(triangle_vertices_f[i*9+j*3]*scale,
-                                               triangle_vertices_f[i*9+j*3+1]*scale,
-                                               triangle_vertices_f[i*9+j*3+2]*scale);
-                triangle_vertices[j] = triangle_vertices[j] - mean_point;
-            }
-            triangles.add(make_shared<triangle>(triangle_vertices,m));
-        }
-    }
-    else{
-        for(int i=0;i<num;i++){
-            std::vector<pointf3> triangle_vertices(3);
-            std::vector<texf2> triangle_texCoord(3);
-            for(int j=0;j<3;j++){
-                triangle_vertices[j] = pointf3(triangle_vertices_f[i*9+j*3]*scale,
-                                               triangle_vertices_f[i*9+j*3+1]*scale,
-                                               triangle_vertices_f[i*9+j*3+2]*scale);
-                triangle_vertices[j] = triangle_vertices[j] - mean_point;
-                triangle_texCoord[j] = texf2(triangle_texCoord_f[i*6+j*2],
-                                             triangle_texCoord_f[i*6+j*2+1]);
+    for (auto &vertice : mesh.positions)
+        vertice = vertice - mean_point;
+
+    // 每个三角形的包围盒，与triangle::bounding_box相同，在厚度为0的方向上稍微扩大
+    std::vector<aabb> tri_bounds(num);
+    for (size_t i = 0; i < num; i++) {
+        const pointf3 &v0 = mesh.positions[mesh.indices[3 * i]];
+        const pointf3 &v1 = mesh.positions[mesh.indices[3 * i + 1]];
+        const pointf3 &v2 = mesh.positions[mesh.indices[3 * i + 2]];
+        pointf3 min_point, max_point;
+        for (int a = 0; a < 3; a++) {
+            min_point.e[a] = std::min(v0[a], std::min(v1[a], v2[a]));
+            max_point.e[a] = std::max(v0[a], std::max(v1[a], v2[a]));
+            if (min_point.e[a] == max_point.e[a]) {
+                min_point.e[a] -= 0.0001;
+                max_point.e[a] += 0.0001;
             }
-            triangles.add(make_shared<triangle>(triangle_vertices,triangle_texCoord,m));
         }
+        tri_bounds[i] = aabb(min_point, max_point);
     }
-    start_time = std::chrono::high_resolution_clock::now();
-    bvh = make_shared<bvh_node>(triangles,0,1);
-    end_time = std::chrono::high_resolution_clock::now();
-    elapsed_seconds = end_time - start_time;
+
+    auto start_time = std::chrono::high_resolution_clock::now();
+    // 叶结点按4个三角形一块求交，SAH按块数计算代价，叶结点最多两块
+    bvh_build_options block_options = options;
+    block_options.leaf_block_size = 4;
+    block_options.max_leaf_size = std::max(options.max_leaf_size, 8);
+    std::vector<int> order;
+    bvh.build(tri_bounds, order, block_options);
+    auto end_time = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end_time - start_time;
     if(elapsed_seconds.count()>0.75)
         std::cout<<"Building BVH takes "<<elapsed_seconds.count()<<" seconds"<<std::endl;
-    mat_ptr = m;
+
+    // 按照叶结点的顺序重排三角形的下标
+    auto reorder = [&](std::vector<int> &inds) {
+        if (inds.size() != 3 * num)
+            return;
+        std::vector<int> sorted(3 * num);
+        for (size_t i = 0; i < num; i++)
+            for (int k = 0; k < 3; k++)
+                sorted[3 * i + k] = inds[3 * order[i] + k];
+        inds.swap(sorted);
+    };
+    reorder(mesh.indices);
+    reorder(mesh.uv_indices);
+    reorder(mesh.normal_indices);
+    buildBlocks();
 }
 
-void mesh_triangle::Init(const std::vector<pointf3> &vertices, const std::vector<int>& faces,shared_ptr<material> m){
-    this->aabb_min = vertices[0];
-    this->aabb_max = vertices[0];
-    for (auto vertice : vertices) {
-        if(vertice.x() < aabb_min.x()) aabb_min.e[0] = vertice.x();
-        if(vertice.y() < aabb_min.y()) aabb_min.e[1] = vertice.y();
-        if(vertice.z() < aabb_min.z()) aabb_min.e[2] = vertice.z();
-        if(vertice.x() > aabb_max.x()) aabb_max.e[0] = vertice.x();
-        if(vertice.y() > aabb_max.y()) aabb_max.e[1] = vertice.y();
-        if(vertice.z() > aabb_max.z()) aabb_max.e[2] = vertice.z();
+void mesh_triangle::buildBlocks() {
+    blocks.clear();
+    for (auto &node: bvh.nodes) {
+        for (int c = 0; c < 4; c++) {
+            if (node.count[c] == 0)
+                continue;
+            int first = node.child[c], count = node.count[c];
+            node.child[c] = static_cast<int>(blocks.size());
+            node.count[c] = (count + 3) / 4;
+            for (int i = 0; i < count; i += 4) {
+                triangle_block4 blk{};
+                for (int k = 0; k < 4; k++) {
+                    if (i + k >= count) {
+                        blk.ids[k] = -1;
+                        continue;
+                    }
+                    int tri = first + i + k;
+                    const pointf3 &v0 = mesh.positions[mesh.indices[3 * tri]];
+                    const pointf3 &v1 = mesh.positions[mesh.indices[3 * tri + 1]];
+                    const pointf3 &v2 = mesh.positions[mesh.indices[3 * tri + 2]];
+                    for (int a = 0; a < 3; a++) {
+                        blk.v0[a][k] = v0[a];
+                        blk.e1[a][k] = v1[a] - v0[a];
+                        blk.e2[a][k] = v2[a] - v0[a];
+                    }
+                    blk.ids[k] = tri;
+                }
+                blocks.push_back(blk);
+            }
+        }
     }
+}
 
-    pointf3 mean_point = (aabb_min + aabb_max) / 2;
+bool mesh_triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
+    int hit_tri = -1;
+    double hit_t = 0, hit_b1 = 0, hit_b2 = 0;
+    block_ray br(r);
+    bool hit_anything = bvh.traverse(r, t_min, t_max, [&](int first, int count, double &closest) {
+        bool found = false;
+        float t[4], b1[4], b2[4];
+        for (int i = first; i < first + count; i++) {
+            int mask = intersect_block4(blocks[i], br, float(t_min), float(closest), t, b1, b2);
+            for (int k = 0; mask; k++, mask >>= 1) {
+                if ((mask & 1) && (!found || t[k] < closest)) {
+                    found = true;
+                    closest = t[k];
+                    hit_tri = blocks[i].ids[k];
+                    hit_b1 = b1[k];
+                    hit_b2 = b2[k];
+                }
+            }
+        }
+        if (found)
+            hit_t = closest;
+        return found;
+    });
+    if (!hit_anything)
+        return false;
+    // 只为最近的交点填写hit_record
+    fillRecord(r, hit_tri, hit_t, hit_b1, hit_b2, rec);
+    return true;
+}
 
-    aabb_min = aabb_min - mean_point;
-    aabb_max = aabb_max - mean_point;
-    num = faces.size() / 3;
-    for (int i = 0; i < faces.size(); i += 3) {
-        pointf3 a = vertices[faces[i]]-mean_point;
-        pointf3 b = vertices[faces[i + 1]]-mean_point;
-        pointf3 c = vertices[faces[i + 2]]-mean_point;
-        triangles.add(make_shared<triangle>(a, b, c, m));
+void mesh_triangle::fillRecord(const ray &r, int hit_tri, double hit_t, double hit_b1, double hit_b2,
+                               hit_record &rec) const {
+    const int *vi = &mesh.indices[3 * hit_tri];
+    const pointf3 &v0 = mesh.positions[vi[0]];
+    const pointf3 &v1 = mesh.positions[vi[1]];
+    const pointf3 &v2 = mesh.positions[vi[2]];
+    pointf3 weight = pointf3(1 - hit_b1 - hit_b2, hit_b1, hit_b2);
+    rec.t = hit_t;
+    rec.p = r.at(hit_t);
+    const int *ti = mesh.uv_indices.empty() ? vi : &mesh.uv_indices[3 * hit_tri];
+    const int *ni = mesh.normal_indices.empty() ? vi : &mesh.normal_indices[3 * hit_tri];
+    // 任何一个顶点缺少属性时，整个三角形都使用默认值
+    bool has_uv = !mesh.uvs.empty() && ti[0] != absent_index && ti[1] != absent_index && ti[2] != absent_index;
+    bool has_normal = !mesh.normals.empty() && ni[0] != absent_index && ni[1] != absent_index &&
+                      ni[2] != absent_index;
+    if (has_uv) {
+        const texf2 &vt0 = mesh.uvs[ti[0]], &vt1 = mesh.uvs[ti[1]], &vt2 = mesh.uvs[ti[2]];
+        rec.u = weight.x() * vt0.x() + weight.y() * vt1.x() + weight.z() * vt2.x();
+        rec.v = weight.x() * vt0.y() + weight.y() * vt1.y() + weight.z() * vt2.y();
+    } else {
+        // 与triangle默认的纹理坐标(0,0),(0,1),(1,0)相同
+        rec.u = weight.z();
+        rec.v = weight.y();
     }
-    auto start_time = std::chrono::high_resolution_clock::now();
-    bvh = make_shared<bvh_node>(triangles,0,1);
-    auto end_time = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end_time - start_time;
-    if(elapsed_seconds.count()>1.0)
-        std::cout<<"Building BVH takes "<<elapsed_seconds.count()<<" seconds"<<std::endl;
-    mat_ptr = m;
+    vecf3 normal;
+    if (has_normal) {
+        normal = unit_vector(weight.x() * mesh.normals[ni[0]] + weight.y() * mesh.normals[ni[1]] +
+                             weight.z() * mesh.normals[ni[2]]);
+    } else {
+        normal = unit_vector(cross(v1 - v0, v2 - v0));
+    }
+    rec.set_face_normal(r, normal);
+    rec.mat_ptr = mat_ptr.get();
+}
+
+// 与hit相同，叶结点中的三角形块依次与包内的每条光线求交
+uint32_t mesh_triangle::hit_packet(const ray *r, uint32_t rays, double t_min, double *t_max, hit_record *recs,
+                                   pcg32 *) const {
+    int hit_tri[bvh_packet::max_size];
+    double hit_b1[bvh_packet::max_size], hit_b2[bvh_packet::max_size];
+    block_ray br[bvh_packet::max_size];
+    for (uint32_t m = rays; m; m &= m - 1)
+        br[lowest_set_bit(m)] = block_ray(r[lowest_set_bit(m)]);
+    uint32_t hits = 0;
+    bvh.traverse_packet(r, rays, t_min, t_max, [&](int first, int count, uint32_t m) {
+        uint32_t found_rays = 0;
+        float t[4], b1[4], b2[4];
+        for (; m; m &= m - 1) {
+            int j = lowest_set_bit(m);
+            bool found = false;
+            for (int i = first; i < first + count; i++) {
+                int mask = intersect_block4(blocks[i], br[j], float(t_min), float(t_max[j]), t, b1, b2);
+                for (int k = 0; mask; k++, mask >>= 1) {
+                    if ((mask & 1) && (!found || t[k] < t_max[j])) {
+                        found = true;
+                        t_max[j] = t[k];
+                        hit_tri[j] = blocks[i].ids[k];
+                        hit_b1[j] = b1[k];
+                        hit_b2[j] = b2[k];
+                    }
+                }
+            }
+            if (found)
+                found_rays |= 1u << j;
+        }
+        hits |= found_rays;
+        return found_rays;
+    });
+    for (uint32_t m = hits; m; m &= m - 1) {
+        int j = lowest_set_bit(m);
+        fillRecord(r[j], hit_tri[j], t_max[j], hit_b1[j], hit_b2[j], recs[j]);
+    }
+    return hits;
 }
 
+uint32_t mesh_triangle::occluded_packet(const ray *r, uint32_t rays, double t_min, const double *t_max,
+                                        pcg32 *) const {
+    block_ray br[bvh_packet::max_size];
+    for (uint32_t m = rays; m; m &= m - 1)
+        br[lowest_set_bit(m)] = block_ray(r[lowest_set_bit(m)]);
+    return bvh.any_hit_packet(r, rays, t_min, t_max, [&](int first, int count, uint32_t m) {
+        uint32_t blocked = 0;
+        float t[4], b1[4], b2[4];
+        for (; m; m &= m - 1) {
+            int j = lowest_set_bit(m);
+            for (int i = first; i < first + count; i++) {
+                if (intersect_block4(blocks[i], br[j], float(t_min), float(t_max[j]), t, b1, b2)) {
+                    blocked |= 1u << j;
+                    break;
+                }
+            }
+        }
+        return blocked;
+    });
+}
 
-bool mesh_triangle::hit(const ray &r, double t_min, double t_max, hit_record &rec) const {
-    return bvh->hit(r, t_min, t_max, rec);
+bool mesh_triangle::occluded(const ray &r, double t_min, double t_max) const {
+    block_ray br(r);
+    return bvh.any_hit(r, t_min, t_max, [&](int first, int count) {
+        float t[4], b1[4], b2[4];
+        for (int i = first; i < first + count; i++) {
+            if (intersect_block4(blocks[i], br, float(t_min), float(t_max), t, b1, b2))
+                return true;
+        }
+        return false;
+    });
 }
 
 bool mesh_triangle::bounding_box(double time0, double time1, aabb &output_box) const {
     output_box = aabb(aabb_min, aabb_max);
     return true;
-}
\ No newline at end of file
+}
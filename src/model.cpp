@@ -1,10 +1,14 @@
 //
 // Created by Runze on 01/07/2023.
 //
-#include <fstream>
-#include <sstream>
+#include <algorithm>
+#include <charconv>
+#include <cstdlib>
+#include <cstring>
 #include <iostream> // cout 函数需要用
+#include <omp.h>
 #include "model.h"
+#include "mapped_file.h"
 
 using namespace std;
 
@@ -71,102 +75,359 @@ std::vector<vecf2> model::getTriangleTexCoords() { return triangle_texCoords; }
 std::vector<vecf3> model::getTriangleNormals() { return triangle_normals; }
 
 
-// -------------- Model Importer class
-ModelImporter::ModelImporter() {}
-void ModelImporter::parseOBJ(const char *filePath) {
-    float x, y, z;
-    string content;
-    ifstream fileStream(filePath, ios::in);
-    string line = "";
-    if (!fileStream.is_open()) {
-        cerr << "Error opening file: " << filePath << endl;
-        exit(1);
-    }
-    int iNum = 0;//调试
-    while (!fileStream.eof()) {
+// -------------- OBJ loader
+namespace {
 
-        getline(fileStream, line);
+// 文件中连续的若干行，count阶段统计元素个数，parse阶段从base开始写入
+struct obj_chunk {
+    const char *begin = nullptr;
+    const char *end = nullptr;
+    size_t n_v = 0, n_vt = 0, n_vn = 0, n_tri = 0;
+    size_t v_base = 0, vt_base = 0, vn_base = 0, tri_base = 0;
+    bool ok = true;
+};
 
-        // 跳过空行和注释行（以 '#' 开头的行）
-        if (line.empty() || line[0] == '#') {
-            continue;
-        }
+enum class obj_line { Other, V, VT, VN, F };
 
-        if (line.compare(0, 2, "v ") == 0) { // vertex position ("v" case)
+inline bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
 
-            stringstream ss(line.erase(0, 1));
-            ss >> x; ss >> y; ss >> z; // extract the vertex position values
+inline const char *skip_space(const char *p, const char *end) {
+    while (p < end && is_space(*p))
+        p++;
+    return p;
+}
 
-            vertVals.push_back(x);
-            vertVals.push_back(y);
-            vertVals.push_back(z);
+// 返回行的类型，p指向关键字之后
+inline obj_line classify(const char *&p, const char *end) {
+    if (end - p >= 2 && p[0] == 'v' && is_space(p[1])) {
+        p += 1;
+        return obj_line::V;
+    }
+    if (end - p >= 3 && p[0] == 'v' && p[1] == 't' && is_space(p[2])) {
+        p += 2;
+        return obj_line::VT;
+    }
+    if (end - p >= 3 && p[0] == 'v' && p[1] == 'n' && is_space(p[2])) {
+        p += 2;
+        return obj_line::VN;
+    }
+    if (end - p >= 2 && p[0] == 'f' && is_space(p[1])) {
+        p += 1;
+        return obj_line::F;
+    }
+    return obj_line::Other;
+}
 
+const char *parse_float(const char *p, const char *end, float &out) {
+    p = skip_space(p, end);
+    if (p < end && *p == '+')
+        p++;
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+    auto res = std::from_chars(p, end, out);
+    if (res.ec == std::errc::result_out_of_range)
+        out = 0;
+    else if (res.ec != std::errc())
+        return nullptr;
+    return res.ptr;
+#else
+    // 标准库不支持浮点数的from_chars时，复制到以0结尾的缓冲区中再用strtof
+    char buf[64];
+    size_t n = 0;
+    while (p + n < end && n < sizeof(buf) - 1 && !is_space(p[n]) && p[n] != '\r' && p[n] != '\n')
+        n++;
+    std::memcpy(buf, p, n);
+    buf[n] = 0;
+    char *stop;
+    out = std::strtof(buf, &stop);
+    if (stop == buf)
+        return nullptr;
+    return p + (stop - buf);
+#endif
+}
 
-        }
-        if (line.compare(0, 2, "vt") == 0) { // texture coordinates ("vt" case)
-            stringstream ss(line.erase(0, 2));
-            ss >> x; ss >> y; // extract texture coordinate values
-            stVals.push_back(x);
-            stVals.push_back(y);
+// 统计f中的顶点个数，不解析数字
+int count_corners(const char *p, const char *end) {
+    int n = 0;
+    while (true) {
+        p = skip_space(p, end);
+        if (p >= end)
+            return n;
+        n++;
+        while (p < end && !is_space(*p))
+            p++;
+    }
+}
 
-        }
-        if (line.compare(0, 2, "vn") == 0) { // vertex normals ("vn" case)
-            stringstream ss(line.erase(0, 2));
-            ss >> x; ss >> y; ss >> z; // extract the normal vector values
-            normVals.push_back(x);
-            normVals.push_back(y);
-            normVals.push_back(z);
+// OBJ的下标从1开始，负数表示相对于目前已读到的元素个数
+inline bool resolve_index(int ref, size_t count_so_far, int &index) {
+    if (ref > 0)
+        index = ref - 1;
+    else if (ref < 0)
+        index = static_cast<int>(count_so_far) + ref;
+    else
+        return false;
+    return true;
+}
 
+// 对chunk中的每一行调用fn(type, p, line_end)，p指向关键字之后，line_end不包括换行符
+template<typename Fn>
+void for_each_line(const obj_chunk &chunk, Fn &&fn) {
+    const char *p = chunk.begin;
+    while (p < chunk.end) {
+        const char *line_end = static_cast<const char *>(std::memchr(p, '\n', chunk.end - p));
+        const char *next = line_end ? line_end + 1 : chunk.end;
+        if (!line_end)
+            line_end = chunk.end;
+        if (line_end > p && line_end[-1] == '\r')
+            line_end--;
+        const char *q = skip_space(p, line_end);
+        obj_line type = classify(q, line_end);
+        if (type != obj_line::Other)
+            fn(type, q, line_end);
+        p = next;
+    }
+}
+
+void count_chunk(obj_chunk &chunk) {
+    for_each_line(chunk, [&](obj_line type, const char *p, const char *end) {
+        switch (type) {
+            case obj_line::V: chunk.n_v++; break;
+            case obj_line::VT: chunk.n_vt++; break;
+            case obj_line::VN: chunk.n_vn++; break;
+            case obj_line::F: {
+                int corners = count_corners(p, end);
+                if (corners >= 3)
+                    chunk.n_tri += corners - 2;
+                break;
+            }
+            default: break;
         }
-        if (line.compare(0, 2, "f ") == 0) {
-            // 注意，这里的 f 后面必须加一个空格，因为line.compare(0, 2, "f ")中表示从索引0开始的2个字符，而f不加空格只有一个字符
-
-            string oneCorner, v, t, n;
-            stringstream ss(line.erase(0, 2));
-            is_normal = !normVals.empty();
-            is_texture = !stVals.empty();
-            for (int i = 0; i < 3; i++) {
-                getline(ss, oneCorner, ' '); // extract triangle face references
-                stringstream oneCornerSS(oneCorner);
-                int vertRef, tcRef, normRef;
-                getline(oneCornerSS, v, '/');
-                vertRef = stoi(v) ;
-                vertRef =vertRef>0? (vertRef - 1) * 3 : (vertVals.size() + vertRef * 3); // "stoi" converts string to integer
-                triangleVerts.push_back(vertVals[vertRef]); // build vector of vertices
-                triangleVerts.push_back(vertVals[vertRef + 1]);
-                triangleVerts.push_back(vertVals[vertRef + 2]);
-                vertInds.push_back(vertRef/3);
-                if(is_texture){
-                    getline(oneCornerSS, t, '/');
-                    if(t.empty()) {
-                        tcRef = stoi(v);
-                    } else{
-                        tcRef = stoi(t);
-                    }
-                    tcRef = tcRef > 0 ?  (tcRef - 1) * 2 : (stVals.size() + tcRef * 2);
-                    textureCoords.push_back(stVals[tcRef]); // build vector of texture coords
-                    textureCoords.push_back(stVals[tcRef + 1]);
-                    stInds.push_back(tcRef/2);
-                }
+    });
+}
 
-                if(is_normal){
-                    getline(oneCornerSS, n, '/');
-                    if(n.empty()) {
-                        normRef = stoi(v);
+void parse_chunk(obj_chunk &chunk, mesh_data &mesh) {
+    size_t v = chunk.v_base, vt = chunk.vt_base, vn = chunk.vn_base, tri = chunk.tri_base;
+    const bool has_uv = !mesh.uv_indices.empty();
+    const bool has_normal = !mesh.normal_indices.empty();
+    for_each_line(chunk, [&](obj_line type, const char *p, const char *end) {
+        if (!chunk.ok)
+            return;
+        float x = 0, y = 0, z = 0;
+        switch (type) {
+            case obj_line::V:
+                if (!(p = parse_float(p, end, x)) || !(p = parse_float(p, end, y)) || !(p = parse_float(p, end, z)))
+                    chunk.ok = false;
+                mesh.positions[v++] = pointf3(x, y, z);
+                break;
+            case obj_line::VT:
+                if (!(p = parse_float(p, end, x)) || !(p = parse_float(p, end, y)))
+                    chunk.ok = false;
+                mesh.uvs[vt++] = texf2(x, y);
+                break;
+            case obj_line::VN:
+                if (!(p = parse_float(p, end, x)) || !(p = parse_float(p, end, y)) || !(p = parse_float(p, end, z)))
+                    chunk.ok = false;
+                mesh.normals[vn++] = vecf3(x, y, z);
+                break;
+            case obj_line::F: {
+                // 每个顶点为 v、v/t、v/t/n 或 v//n，第k(k>=2)个顶点与第0个和第k-1个顶点组成一个三角形
+                int first[3] = {0, 0, 0}, prev[3] = {0, 0, 0};
+                int k = 0;
+                while (true) {
+                    p = skip_space(p, end);
+                    if (p >= end)
+                        break;
+                    int refs[3] = {0, 0, 0};
+                    auto res = std::from_chars(p, end, refs[0]);
+                    if (res.ec != std::errc()) {
+                        chunk.ok = false;
+                        return;
+                    }
+                    p = res.ptr;
+                    for (int slot = 1; slot < 3 && p < end && *p == '/'; slot++) {
+                        p++;
+                        if (p < end && *p != '/' && !is_space(*p)) {
+                            res = std::from_chars(p, end, refs[slot]);
+                            if (res.ec != std::errc()) {
+                                chunk.ok = false;
+                                return;
+                            }
+                            p = res.ptr;
+                        }
+                    }
+                    // 省略的纹理或法向量下标记为absent_index，不借用顶点下标
+                    int corner[3] = {absent_index, absent_index, absent_index};
+                    if (!resolve_index(refs[0], v, corner[0]) ||
+                        (refs[1] != 0 && !resolve_index(refs[1], vt, corner[1])) ||
+                        (refs[2] != 0 && !resolve_index(refs[2], vn, corner[2]))) {
+                        chunk.ok = false;
+                        return;
                     }
-                    else{
-                        normRef = stoi(n);
+                    if (k == 0)
+                        std::copy(corner, corner + 3, first);
+                    if (k >= 2 && tri < chunk.tri_base + chunk.n_tri) {
+                        const int *tri_corners[3] = {first, prev, corner};
+                        for (int c = 0; c < 3; c++) {
+                            mesh.indices[3 * tri + c] = tri_corners[c][0];
+                            if (has_uv)
+                                mesh.uv_indices[3 * tri + c] = tri_corners[c][1];
+                            if (has_normal)
+                                mesh.normal_indices[3 * tri + c] = tri_corners[c][2];
+                        }
+                        tri++;
                     }
-                    normRef = normRef>0 ? (normRef - 1) * 3 : (normVals.size() + normRef * 3);
-                    normals.push_back(normVals[normRef]); //… and normals
-                    normals.push_back(normVals[normRef + 1]);
-                    normals.push_back(normVals[normRef + 2]);
-                    normInds.push_back(normRef/3);
+                    std::copy(corner, corner + 3, prev);
+                    k++;
                 }
+                break;
             }
+            default: break;
+        }
+    });
+}
+
+// allow_absent为true时，absent_index也是合法的下标
+bool indices_in_range(const std::vector<int> &indices, size_t count, bool allow_absent) {
+    bool ok = true;
+    const long long n = static_cast<long long>(indices.size());
+#pragma omp parallel for reduction(&&:ok)
+    for (long long i = 0; i < n; i++)
+        ok = ok && ((indices[i] >= 0 && static_cast<size_t>(indices[i]) < count) ||
+                    (allow_absent && indices[i] == absent_index));
+    return ok;
+}
+
+} // namespace
+
+bool load_obj(const std::string &filename, mesh_data &mesh) {
+    mapped_file file;
+    if (!file.open(filename)) {
+        cerr << "Error opening file: " << filename << endl;
+        return false;
+    }
+    return parse_obj(file.data(), file.size(), mesh, filename);
+}
 
+bool parse_obj(const char *data, size_t size, mesh_data &mesh, const std::string &filename) {
+    mesh = mesh_data();
+    if (size == 0)
+        return true;
+
+    // 每块至少1MB，块数为线程数的几倍以平衡负载；块的边界移动到下一个换行符之后
+    const size_t min_chunk = size_t(1) << 20;
+    size_t n_chunks = std::min<size_t>(std::max<size_t>(size / min_chunk, 1), 4 * omp_get_max_threads());
+    std::vector<obj_chunk> chunks;
+    const char *p = data;
+    for (size_t c = 0; c < n_chunks && p < data + size; c++) {
+        const char *end = data + std::min(size, size * (c + 1) / n_chunks);
+        if (end < p)
+            end = p;
+        if (end < data + size) {
+            const char *nl = static_cast<const char *>(std::memchr(end, '\n', data + size - end));
+            end = nl ? nl + 1 : data + size;
+        }
+        obj_chunk chunk;
+        chunk.begin = p;
+        chunk.end = end;
+        chunks.push_back(chunk);
+        p = end;
+    }
+    const int n = static_cast<int>(chunks.size());
+
+#pragma omp parallel for schedule(dynamic, 1) if(n > 1)
+    for (int c = 0; c < n; c++)
+        count_chunk(chunks[c]);
+
+    size_t n_v = 0, n_vt = 0, n_vn = 0, n_tri = 0;
+    for (auto &chunk: chunks) {
+        chunk.v_base = n_v;
+        chunk.vt_base = n_vt;
+        chunk.vn_base = n_vn;
+        chunk.tri_base = n_tri;
+        n_v += chunk.n_v;
+        n_vt += chunk.n_vt;
+        n_vn += chunk.n_vn;
+        n_tri += chunk.n_tri;
+    }
+    mesh.positions.resize(n_v);
+    mesh.uvs.resize(n_vt);
+    mesh.normals.resize(n_vn);
+    mesh.indices.resize(3 * n_tri);
+    if (n_vt > 0)
+        mesh.uv_indices.resize(3 * n_tri);
+    if (n_vn > 0)
+        mesh.normal_indices.resize(3 * n_tri);
+
+#pragma omp parallel for schedule(dynamic, 1) if(n > 1)
+    for (int c = 0; c < n; c++)
+        parse_chunk(chunks[c], mesh);
+
+    for (const auto &chunk: chunks) {
+        if (!chunk.ok) {
+            cerr << "Error parsing file: " << filename << endl;
+            mesh = mesh_data();
+            return false;
         }
     }
+    if (!indices_in_range(mesh.indices, n_v, false) || !indices_in_range(mesh.uv_indices, n_vt, true) ||
+        !indices_in_range(mesh.normal_indices, n_vn, true)) {
+        cerr << "Face index out of range in file: " << filename << endl;
+        mesh = mesh_data();
+        return false;
+    }
+    return true;
+}
+
+// -------------- Model Importer class
+ModelImporter::ModelImporter() {}
+void ModelImporter::parseOBJ(const char *filePath) {
+    mesh_data mesh;
+    if (!load_obj(filePath, mesh))
+        exit(1);
+    is_texture = !mesh.uvs.empty();
+    is_normal = !mesh.normals.empty();
+
+    vertVals.resize(3 * mesh.positions.size());
+    for (size_t i = 0; i < mesh.positions.size(); i++)
+        for (int a = 0; a < 3; a++)
+            vertVals[3 * i + a] = mesh.positions[i][a];
+    stVals.resize(2 * mesh.uvs.size());
+    for (size_t i = 0; i < mesh.uvs.size(); i++) {
+        stVals[2 * i] = mesh.uvs[i].x();
+        stVals[2 * i + 1] = mesh.uvs[i].y();
+    }
+    normVals.resize(3 * mesh.normals.size());
+    for (size_t i = 0; i < mesh.normals.size(); i++)
+        for (int a = 0; a < 3; a++)
+            normVals[3 * i + a] = mesh.normals[i][a];
+
+    // 按三角形展开的顶点属性
+    const size_t n_corners = mesh.indices.size();
+    triangleVerts.resize(3 * n_corners);
+    textureCoords.resize(is_texture ? 2 * n_corners : 0);
+    normals.resize(is_normal ? 3 * n_corners : 0);
+    for (size_t i = 0; i < n_corners; i++) {
+        std::copy_n(&vertVals[3 * mesh.indices[i]], 3, &triangleVerts[3 * i]);
+        if (is_texture && mesh.uv_indices[i] != absent_index)
+            std::copy_n(&stVals[2 * mesh.uv_indices[i]], 2, &textureCoords[2 * i]);
+        if (is_normal && mesh.normal_indices[i] != absent_index)
+            std::copy_n(&normVals[3 * mesh.normal_indices[i]], 3, &normals[3 * i]);
+    }
+    // 没有给出法向量的顶点使用三角形的几何法向量，没有纹理坐标的顶点保持为(0,0)
+    for (size_t t = 0; is_normal && t < n_corners / 3; t++) {
+        const float *p = &triangleVerts[9 * t];
+        vecf3 n = unit_vector(cross(vecf3(p[3] - p[0], p[4] - p[1], p[5] - p[2]),
+                                    vecf3(p[6] - p[0], p[7] - p[1], p[8] - p[2])));
+        for (int c = 0; c < 3; c++)
+            if (mesh.normal_indices[3 * t + c] == absent_index)
+                for (int a = 0; a < 3; a++)
+                    normals[9 * t + 3 * c + a] = n[a];
+    }
+    vertInds = std::move(mesh.indices);
+    stInds = std::move(mesh.uv_indices);
+    normInds = std::move(mesh.normal_indices);
 }
 
 int ModelImporter::getNumVertices() { return (vertVals.size() / 3); } // accessors  // 先注释，为了调试，等调试结束再解除注释
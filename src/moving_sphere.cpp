@@ -23,11 +23,29 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     rec.p = r.at(rec.t);
     vecf3 outward_normal = (rec.p - center(r.time())) / radius;//normal vector change with time
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
 
     return true;
 }
 
+bool moving_sphere::occluded(const ray& r, double t_min, double t_max) const {
+    vecf3 oc = r.origin() - center(r.time());
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+    auto root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+    return true;
+}
+
 bool moving_sphere::bounding_box(double _time0, double _time1, aabb& output_box) const {
     aabb box0(
         center(_time0) - vecf3(radius, radius, radius),
@@ -72,6 +72,6 @@ bool participate_medium::hit(const ray& r, double t_min, double t_max, hit_recor
     rec.t = rec1.t;
     rec.normal = vecf3(1, 0, 0);  // arbitrary
     rec.front_face = true;       // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
     return true;
 }
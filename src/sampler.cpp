@@ -0,0 +1,216 @@
+#include "sampler.h"
+#include <algorithm>
+
+static constexpr double one_minus_epsilon = 0x1.fffffffffffffp-1;
+
+// 哈希得到[0,1)中的数
+static double hash_double(uint64_t h) {
+    return (mix_bits(h) >> 11) * 0x1p-53;
+}
+
+// Kensler的哈希置换：返回[0,l)的一个由p决定的随机排列中的第i个元素，不需要存储排列
+static int permutation_element(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return static_cast<int>((i + p) % l);
+}
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// 基于哈希的二进制Owen打乱(Burley 2020)：每一位的翻转只取决于更高的位
+static uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+/*------------------------------ 分层采样 ------------------------------*/
+
+// 第index个采样在本轮中所在的层，每一轮和每个维度的层的顺序都不同
+static int stratum(int index, int strata, int spp, uint64_t h) {
+    uint32_t round = static_cast<uint32_t>(index / spp);
+    return permutation_element(static_cast<uint32_t>(index % spp), strata,
+                               static_cast<uint32_t>(mix_bits(h + round)));
+}
+
+double stratified_sampler::get_1d() {
+    uint64_t h = next_dimension_hash();
+    int s = stratum(index, samples_per_pixel, samples_per_pixel, h);
+    double jitter = hash_double(h ^ (0xa0761d6478bd642fULL * (index + 1)));
+    return std::min((s + jitter) / samples_per_pixel, one_minus_epsilon);
+}
+
+pointd2 stratified_sampler::get_2d() {
+    uint64_t h = next_dimension_hash();
+    // nx*ny个层中随机选spp个，spp是平方数时正好是完整的网格
+    int nx = static_cast<int>(std::ceil(std::sqrt(double(samples_per_pixel))));
+    int ny = (samples_per_pixel + nx - 1) / nx;
+    int s = stratum(index, nx * ny, samples_per_pixel, h);
+    double jx = hash_double(h ^ (0xa0761d6478bd642fULL * (index + 1)));
+    double jy = hash_double(h ^ (0xe7037ed1a0b428dbULL * (index + 1)));
+    return pointd2(std::min((s % nx + jx) / nx, one_minus_epsilon),
+                   std::min((s / nx + jy) / ny, one_minus_epsilon));
+}
+
+/*------------------------------ Halton ------------------------------*/
+
+static const int halton_primes[] = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+        137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+        227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+static constexpr int halton_max_dimension = sizeof(halton_primes) / sizeof(halton_primes[0]);
+
+// 以base为底的根式反演，每一位的数字按已经出现的高位数字决定的随机置换打乱(Owen打乱)
+static double owen_radical_inverse(int base, uint64_t a, uint64_t hash) {
+    const double inv_base = 1.0 / base;
+    double inv_base_m = 1;
+    uint64_t reversed = 0;
+    while (inv_base_m > 0x1p-40) {
+        uint64_t next = a / base;
+        int digit = static_cast<int>(a - next * base);
+        digit = permutation_element(digit, base, static_cast<uint32_t>(mix_bits(hash ^ reversed)));
+        reversed = reversed * base + digit;
+        inv_base_m *= inv_base;
+        a = next;
+    }
+    return std::min(inv_base_m * reversed, one_minus_epsilon);
+}
+
+double halton_sampler::get_1d() {
+    int d = dim;
+    uint64_t h = next_dimension_hash();
+    if (d >= halton_max_dimension)
+        return hash_double(h ^ (0xa0761d6478bd642fULL * (index + 1)));
+    return owen_radical_inverse(halton_primes[d], index, h);
+}
+
+pointd2 halton_sampler::get_2d() {
+    double u = get_1d();
+    return pointd2(u, get_1d());
+}
+
+/*------------------------------ Sobol ------------------------------*/
+
+// Sobol序列的前两维：第一维是van der Corput序列，第二维的生成矩阵是帕斯卡三角形模2
+static uint32_t sobol_0(uint32_t i) {
+    return reverse_bits(i);
+}
+
+static uint32_t sobol_1(uint32_t i) {
+    uint32_t v = 1u << 31, result = 0;
+    for (; i; i >>= 1, v ^= v >> 1)
+        if (i & 1)
+            result ^= v;
+    return result;
+}
+
+// 每个维度(或一组二维)的采样顺序也要打乱，否则不同维度之间会出现相关
+double sobol_sampler::get_1d() {
+    uint64_t h = next_dimension_hash();
+    uint32_t i = owen_scramble(static_cast<uint32_t>(index), static_cast<uint32_t>(h));
+    return std::min(owen_scramble(sobol_0(i), static_cast<uint32_t>(h >> 32)) * 0x1p-32, one_minus_epsilon);
+}
+
+pointd2 sobol_sampler::get_2d() {
+    uint64_t h = next_dimension_hash();
+    uint64_t h2 = mix_bits(h);
+    uint32_t i = owen_scramble(static_cast<uint32_t>(index), static_cast<uint32_t>(h));
+    return pointd2(std::min(owen_scramble(sobol_0(i), static_cast<uint32_t>(h >> 32)) * 0x1p-32, one_minus_epsilon),
+                   std::min(owen_scramble(sobol_1(i), static_cast<uint32_t>(h2)) * 0x1p-32, one_minus_epsilon));
+}
+
+/*------------------------------ R2 ------------------------------*/
+
+// 黄金分割比和塑性数(x^3 = x + 1)的倒数，是一维和二维中最均匀的加性递推系数
+static constexpr double r1_alpha = 0.6180339887498948482;
+static constexpr double r2_alpha1 = 0.7548776662466927600;
+static constexpr double r2_alpha2 = 0.5698402909980532659;
+
+static double fract(double x) {
+    return x - std::floor(x);
+}
+
+/*  R2的打乱只由维度决定，所有像素相同，像素之间只差R2抖动 x*a1 + y*a2：相邻像素的抖动相差很大且分布均匀，
+    误差在屏幕上呈蓝噪声分布。如果再加上每个像素不同的随机平移，抖动就被抵消，误差成为白噪声。
+
+    一个像素内的spp个点间距约为1/spp(二维时每个方向约为1/sqrt(spp))，平移整数个间距后点集几乎不变，
+    所以抖动缩放到一个间距之内，否则相邻像素的点集几乎相同，误差反而正相关。
+    不同维度的采样顺序按维度打乱(与padded Sobol相同)，像素坐标也按维度异或一个常数再计算抖动，
+    避免各个维度之间相关。
+*/
+static int r2_index(int index, int spp, uint64_t h) {
+    return index / spp * spp + permutation_element(static_cast<uint32_t>(index % spp), spp, static_cast<uint32_t>(h));
+}
+
+static double r2_dither(int px, int py, uint64_t h, bool transpose) {
+    int x = px ^ static_cast<int>((h >> 40) & 0xffff), y = py ^ static_cast<int>((h >> 24) & 0xffff);
+    if (transpose)
+        std::swap(x, y);
+    return fract(x * r2_alpha1 + y * r2_alpha2);
+}
+
+double r2_sampler::get_1d() {
+    uint64_t h = next_shared_dimension_hash();
+    double offset = hash_double(h) + r2_dither(px, py, h, false) / samples_per_pixel;
+    return std::min(fract(offset + r2_index(index, samples_per_pixel, h) * r1_alpha), one_minus_epsilon);
+}
+
+pointd2 r2_sampler::get_2d() {
+    uint64_t h = next_shared_dimension_hash();
+    double spacing = 1.0 / std::sqrt(double(samples_per_pixel));
+    double ox = hash_double(h) + r2_dither(px, py, h, false) * spacing;
+    double oy = hash_double(h + 1) + r2_dither(px, py, h, true) * spacing;
+    int i = r2_index(index, samples_per_pixel, h);
+    return pointd2(std::min(fract(ox + i * r2_alpha1), one_minus_epsilon),
+                   std::min(fract(oy + i * r2_alpha2), one_minus_epsilon));
+}
+
+std::unique_ptr<sampler> create_sampler(sampler_type type, int spp) {
+    switch (type) {
+        case sampler_type::Stratified:
+            return std::make_unique<stratified_sampler>(spp);
+        case sampler_type::Halton:
+            return std::make_unique<halton_sampler>(spp);
+        case sampler_type::Sobol:
+            return std::make_unique<sobol_sampler>(spp);
+        case sampler_type::R2:
+            return std::make_unique<r2_sampler>(spp);
+        default:
+            return std::make_unique<independent_sampler>(spp);
+    }
+}
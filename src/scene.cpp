@@ -13,7 +13,8 @@ void cornell_box(Scene& scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(light_rect);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -31,7 +32,7 @@ void cornell_box(Scene& scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -59,7 +60,8 @@ void cornell_specular(Scene& scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(light_rect);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -80,7 +82,7 @@ void cornell_specular(Scene& scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -111,7 +113,8 @@ void cornell_triangle_glass(Scene &scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(163, 393, 177, 382, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(163, 393, 177, 382, 554, light));
+    objects.add(light_rect);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -144,7 +147,7 @@ void cornell_triangle_glass(Scene &scene){
     scene.world = objects;
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(163, 393, 177, 382, 554,  shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -175,7 +178,8 @@ void cornell_mesh_objects(Scene &scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(light_rect);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -200,7 +204,7 @@ void cornell_mesh_objects(Scene &scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(113, 443, 127, 432, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -229,7 +233,8 @@ void cornell_smoke(Scene &scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(light_rect);
 //    objects.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
 
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
@@ -251,7 +256,7 @@ void cornell_smoke(Scene &scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(113, 443, 127, 432, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -282,7 +287,8 @@ void cornell_mitsuba(Scene &scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(light_rect);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -309,7 +315,7 @@ void cornell_mitsuba(Scene &scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(113, 443, 127, 432, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -343,7 +349,8 @@ void cornell_zoom(Scene &scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(153, 403, 197, 392, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(153, 403, 197, 392, 554, light));
+    objects.add(light_rect);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -378,7 +385,7 @@ void cornell_zoom(Scene &scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(153, 403, 197, 392, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -395,6 +402,64 @@ void cornell_zoom(Scene &scene){
     scene.height = image_height;
 }
 
+// 同一个网格的多个实例：所有instance共享一个mesh_triangle及其BVH，每个实例只有自己的变换和材质
+void cornell_instances(Scene &scene){
+    //BACKGROUND
+    scene.background = make_shared<solid_color>(0.1,0.1,0.1);
+
+    //WORLD
+    hittable_list objects;
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(light_rect);
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+    std::string obj_filename = "../data/spot/spot.obj";
+    auto texture = make_shared<lambertian>(make_shared<image_texture>("../data/spot/spot_texture.png"));
+    auto aluminum = make_shared<metal>(color(0.8, 0.85, 0.88), 0.1);
+    shared_ptr<hittable> spot = make_shared<mesh_triangle>(obj_filename, texture);
+
+    // 4x4排列，每个实例的朝向和大小不同，一半使用网格自己的纹理材质，另一半替换成金属
+    const int n = 4;
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            double s = 55 + 10 * ((i + 2 * j) % 3);
+            double angle = 30 + 45 * (i * n + j);
+            vecf3 position(95 + 120 * i, 0.83 * s, 140 + 110 * j);
+            affine3 object_to_world = affine3::translation(position) * affine3::rotation(1, angle) *
+                                      affine3::scaling(vecf3(s, s, s));
+            objects.add(make_shared<instance>(spot, object_to_world, (i + j) % 2 ? aluminum : nullptr));
+        }
+    }
+    scene.world = objects;
+
+    //LIGHTS
+    scene.lights = make_shared<hittable_list>();
+    scene.lights->add(light_rect);
+
+    //CAMERA
+    double aspect_ratio = 1.0;
+    int image_width = 600;
+    pointf3 lookfrom(278, 400, -600);
+    pointf3 lookat(278, 120, 300);
+    double vfov = 40.0;
+    double aperture = 0.0;
+    vecf3 vup(0, 1, 0);
+    auto dist_to_focus = 10.0;
+    int image_height = static_cast<int>(image_width / aspect_ratio);
+    scene.cam = make_shared<camera>(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+    scene.width = image_width;
+    scene.height = image_height;
+}
+
 void final_scene(Scene &scene){
     scene.background = make_shared<solid_color>(color(0, 0, 0)) ;
 
@@ -421,7 +486,8 @@ void final_scene(Scene &scene){
     objects.add(make_shared<bvh_node>(boxes1, 0, 1));
 
     auto light = make_shared<diffuse_light>(color(7, 7, 7));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(123, 423, 147, 412, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
+    objects.add(light_rect);
 
 
     auto center1 = pointf3(400, 400, 200);
@@ -460,7 +526,7 @@ void final_scene(Scene &scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -493,7 +559,8 @@ void test_scene(Scene & scene){
 
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
     objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<flip_face>(make_shared<xz_rect>(153, 403, 197, 392, 554, light)));
+    auto light_rect = make_shared<flip_face>(make_shared<xz_rect>(153, 403, 197, 392, 554, light));
+    objects.add(light_rect);
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
     objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
     objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
@@ -526,7 +593,7 @@ void test_scene(Scene & scene){
 
     //LIGHTS
     scene.lights = make_shared<hittable_list>();
-    scene.lights->add(make_shared<xz_rect>(153, 403, 197, 392, 554, shared_ptr<material>()));
+    scene.lights->add(light_rect);
 
     //CAMERA
     double aspect_ratio = 1.0;
@@ -25,7 +25,26 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec)const
     vecf3 outward_normal = (rec.p-center)/radius;
     rec.set_face_normal(r,outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);//根据三维位置获取球面的纹理坐标
-    rec.mat_ptr = mat_ptr;//返回材料性质
+    rec.mat_ptr = mat_ptr.get();//返回材料性质
+    return true;
+}
+
+bool sphere::occluded(const ray& r, double t_min, double t_max) const {
+    vecf3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    if(a==0) return false;
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b*half_b - a*c;
+    if(discriminant<0) return false;
+    auto sqrtd = sqrt(discriminant);
+    auto root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
     return true;
 }
 
@@ -48,11 +67,10 @@ double sphere::pdf_value(const pointf3& o, const vecf3& v) const {
         //如果光源在球外部
         return 0;
     }
-    hit_record rec;
-    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+    //方向在球所张的圆锥内才会与球相交，不需要求交点
+    auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+    if (dot(v, direction) < cos_theta_max * v.length() * sqrt(distance_squared))
         return 0;
-
-    auto cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
     auto solid_angle = 2 * pi * (1 - cos_theta_max);
 
     return  1 / solid_angle;
@@ -75,3 +93,22 @@ vecf3 sphere::random(const vecf3& o) const {
     }
 
 }
+
+double sphere::sample(const pointf3& o, const pointd2& u, hit_record& rec) const {
+    vecf3 direction = center - o;
+    auto distance_squared = direction.length_squared();
+    vecf3 v;
+    if (distance_squared < radius * radius) {
+        v = uniform_on_unit_sphere(u);
+    } else if (distance_squared == radius * radius) {
+        return 0;
+    } else {
+        onb uvw;
+        uvw.build_from_w(direction);
+        v = uvw.local(random_to_sphere(radius, distance_squared, u));
+    }
+    if (!hit(ray(o, v), 0.001, infinity, rec))
+        return 0;
+    rec.t *= v.length();
+    return pdf_value(o, v);
+}
@@ -0,0 +1,177 @@
+#include "thread_affinity.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <fstream>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__linux__) && !defined(_WIN32)
+// 解析"0-3,8,10-11"形式的处理器列表
+static std::vector<int> parse_cpu_list(const std::string &s) {
+    std::vector<int> result;
+    const char *p = s.c_str();
+    while (*p) {
+        char *end;
+        long lo = std::strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            hi = std::strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long c = lo; c <= hi; c++)
+            result.push_back(static_cast<int>(c));
+        if (*p != ',')
+            break;
+        p++;
+    }
+    return result;
+}
+
+static std::string read_line(const std::string &path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+#endif
+
+// 当前进程允许使用的处理器
+static std::vector<bool> allowed_cpus() {
+    std::vector<bool> allowed;
+#ifdef _WIN32
+    DWORD_PTR process_mask, system_mask;
+    if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+        for (int c = 0; c < static_cast<int>(8 * sizeof(DWORD_PTR)); c++)
+            allowed.push_back((process_mask >> c) & 1);
+    }
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            allowed.push_back(CPU_ISSET(c, &set));
+    }
+#endif
+    return allowed;
+}
+
+// 每个NUMA结点的编号和它的处理器
+static std::vector<std::pair<int, std::vector<int>>> numa_nodes() {
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+#ifdef _WIN32
+    ULONG highest = 0;
+    if (GetNumaHighestNodeNumber(&highest)) {
+        for (ULONG n = 0; n <= highest; n++) {
+            ULONGLONG mask = 0;
+            if (!GetNumaNodeProcessorMask(static_cast<UCHAR>(n), &mask) || mask == 0)
+                continue;
+            std::vector<int> cpus;
+            for (int c = 0; c < 64; c++)
+                if ((mask >> c) & 1)
+                    cpus.push_back(c);
+            nodes.emplace_back(static_cast<int>(n), cpus);
+        }
+    }
+#elif defined(__linux__)
+    for (int n: parse_cpu_list(read_line("/sys/devices/system/node/possible"))) {
+        std::vector<int> cpus = parse_cpu_list(
+                read_line("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist"));
+        if (!cpus.empty())
+            nodes.emplace_back(n, cpus);
+    }
+#endif
+    return nodes;
+}
+
+const cpu_topology &cpu_topology::get() {
+    static const cpu_topology topology = []() {
+        cpu_topology t;
+        std::vector<bool> allowed = allowed_cpus();
+        std::vector<bool> taken(allowed.size(), false);
+        for (const auto &node: numa_nodes()) {
+            for (int c: node.second) {
+                if (c < static_cast<int>(allowed.size()) && allowed[c] && !taken[c]) {
+                    taken[c] = true;
+                    t.cpus.push_back(c);
+                    t.nodes.push_back(node.first);
+                }
+            }
+        }
+        // 没有结点信息的处理器放在最后
+        for (int c = 0; c < static_cast<int>(allowed.size()); c++) {
+            if (allowed[c] && !taken[c]) {
+                t.cpus.push_back(c);
+                t.nodes.push_back(t.nodes.empty() ? 0 : t.nodes.back());
+            }
+        }
+        return t;
+    }();
+    return topology;
+}
+
+int cpu_topology::cpu_for_worker(int worker, int num_workers) const {
+    int n = static_cast<int>(cpus.size());
+    if (n == 0 || num_workers <= 0)
+        return -1;
+    // 线程比处理器少时隔开分布，比处理器多时相邻的几个线程共用一个处理器
+    return cpus[static_cast<long long>(worker % num_workers) * n / num_workers];
+}
+
+int cpu_topology::node_count() const {
+    std::vector<int> distinct = nodes;
+    std::sort(distinct.begin(), distinct.end());
+    return static_cast<int>(std::unique(distinct.begin(), distinct.end()) - distinct.begin());
+}
+
+thread_pin::thread_pin(int cpu) {
+    if (cpu < 0)
+        return;
+#ifdef _WIN32
+    if (cpu >= static_cast<int>(8 * sizeof(DWORD_PTR)))
+        return;
+    DWORD_PTR old_mask = SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu);
+    if (old_mask != 0) {
+        saved_mask.resize(sizeof(old_mask));
+        std::memcpy(saved_mask.data(), &old_mask, sizeof(old_mask));
+    }
+#elif defined(__linux__)
+    if (cpu >= CPU_SETSIZE)
+        return;
+    cpu_set_t old_set, set;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(old_set), &old_set) != 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        saved_mask.resize(sizeof(old_set));
+        std::memcpy(saved_mask.data(), &old_set, sizeof(old_set));
+    }
+#endif
+}
+
+thread_pin::~thread_pin() {
+    if (saved_mask.empty())
+        return;
+#ifdef _WIN32
+    DWORD_PTR old_mask;
+    std::memcpy(&old_mask, saved_mask.data(), sizeof(old_mask));
+    SetThreadAffinityMask(GetCurrentThread(), old_mask);
+#elif defined(__linux__)
+    cpu_set_t old_set;
+    std::memcpy(&old_set, saved_mask.data(), sizeof(old_set));
+    pthread_setaffinity_np(pthread_self(), sizeof(old_set), &old_set);
+#endif
+}
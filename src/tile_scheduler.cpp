@@ -0,0 +1,107 @@
+#include "tile_scheduler.h"
+#include <algorithm>
+
+void TileScheduler::init(int width, int height, int tile_size, int num_workers) {
+    tile_size = std::max(tile_size, 1);
+    num_workers = std::max(num_workers, 1);
+    tiles.clear();
+    for (int y = 0; y < height; y += tile_size) {
+        for (int x = 0; x < width; x += tile_size) {
+            Tile tile;
+            tile.index = static_cast<int>(tiles.size());
+            tile.x0 = x;
+            tile.y0 = y;
+            tile.x1 = std::min(x + tile_size, width);
+            tile.y1 = std::min(y + tile_size, height);
+            tiles.push_back(tile);
+        }
+    }
+
+    // 每个线程分到一段连续的块
+    queues.clear();
+    for (int w = 0; w < num_workers; w++)
+        queues.push_back(std::make_unique<WorkQueue>());
+    int n = tileCount();
+    for (int w = 0; w < num_workers; w++) {
+        int begin = static_cast<int>(static_cast<long long>(n) * w / num_workers);
+        int end = static_cast<int>(static_cast<long long>(n) * (w + 1) / num_workers);
+        for (int k = begin; k < end; k++)
+            queues[w]->tiles.push_back(k);
+    }
+    finished = 0;
+    steals = 0;
+}
+
+bool TileScheduler::popLocal(int worker, int &index) {
+    WorkQueue &q = *queues[worker];
+    std::lock_guard<std::mutex> guard(q.lock);
+    if (q.tiles.empty())
+        return false;
+    index = q.tiles.front();
+    q.tiles.pop_front();
+    return true;
+}
+
+bool TileScheduler::steal(int worker, int &index) {
+    int n = static_cast<int>(queues.size());
+    for (int k = 1; k < n; k++) {
+        WorkQueue &q = *queues[(worker + k) % n];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tiles.empty())
+            continue;
+        // 从后端窃取，离队列主人当前处理的区域最远
+        index = q.tiles.back();
+        q.tiles.pop_back();
+        steals++;
+        return true;
+    }
+    return false;
+}
+
+bool TileScheduler::next(int worker, Tile &tile) {
+    if (queues.empty())
+        return false;
+    // 实际线程数可能多于队列数，多出的线程只负责窃取
+    int index;
+    if (worker < static_cast<int>(queues.size()) && popLocal(worker, index)) {
+        tile = tiles[index];
+        tile.worker = worker;
+        return true;
+    }
+    if (steal(worker % static_cast<int>(queues.size()), index)) {
+        tile = tiles[index];
+        tile.worker = worker;
+        return true;
+    }
+    return false;
+}
+
+int TileScheduler::finish(const Tile &tile, double time_ms) {
+    // 每个块只会被一个线程渲染，所以这里不需要加锁
+    tiles[tile.index].worker = tile.worker;
+    tiles[tile.index].time_ms = time_ms;
+    return ++finished;
+}
+
+void TileScheduler::reportTiming(std::ostream &out, const std::vector<Tile> &tiles, int steals) {
+    if (tiles.empty())
+        return;
+    double min_ms = tiles[0].time_ms, max_ms = tiles[0].time_ms, sum_ms = 0;
+    int slowest = 0;
+    for (const auto &tile: tiles) {
+        min_ms = std::min(min_ms, tile.time_ms);
+        if (tile.time_ms > max_ms) {
+            max_ms = tile.time_ms;
+            slowest = tile.index;
+        }
+        sum_ms += tile.time_ms;
+    }
+    const Tile &s = tiles[slowest];
+    out << "Tiles: " << tiles.size();
+    if (steals >= 0)
+        out << " | steals: " << steals;
+    out << " | time per tile(ms) min " << min_ms
+        << " avg " << sum_ms / tiles.size()
+        << " max " << max_ms
+        << " @(" << s.x0 << "," << s.y0 << ")" << std::endl;
+}
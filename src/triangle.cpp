@@ -145,13 +145,38 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     rec.t = t;
     rec.p = r.at(t);
     get_triangle_uv(weight,rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
     vecf3 normal = unit_vector(weight.x() * vn1 + weight.y() * vn2 + weight.z() * vn3);
     rec.set_face_normal(r, normal);
 
     return true;
 }
 
+bool triangle::occluded(const ray& r, double t_min, double t_max) const {
+    double t, u, v;
+    return intersect(r, t_min, t_max, t, u, v);
+}
+
+bool triangle::intersect(const ray& r, double t_min, double t_max, double& t, double& u, double& v) const {
+    vecf3 edge1 = v1 - v0;
+    vecf3 edge2 = v2 - v0;
+    vecf3 h = cross(r.direction(), edge2);
+    auto a = dot(edge1, h);
+    if (a == 0)
+        return false;
+    auto f = 1.0 / a;
+    vecf3 s = r.origin() - v0;
+    u = f * dot(s, h);
+    if (u < 0.0 || u > 1.0)
+        return false;
+    vecf3 q = cross(s, edge1);
+    v = f * dot(r.direction(), q);
+    if (v < 0.0 || u + v > 1.0)
+        return false;
+    t = f * dot(edge2, q);
+    return t >= t_min && t <= t_max;
+}
+
 bool triangle::bounding_box(double time0, double time1, aabb& output_box) const {
     pointf3 min_point, max_point;
     min_point = pointf3(
@@ -181,3 +206,47 @@ bool triangle::bounding_box(double time0, double time1, aabb& output_box) const
     return true;
 }
 
+double triangle::pdf_value(const pointf3& o, const vecf3& v) const {
+    double t, b1, b2;
+    if (!intersect(ray(o, v), 0.001, infinity, t, b1, b2))
+        return 0;
+    vecf3 n = cross(v1 - v0, v2 - v0);
+    auto distance_squared = t * t * v.length_squared();
+    auto cosine = fabs(dot(v, n)) / (v.length() * n.length());
+    return distance_squared / (cosine * area());
+}
+
+vecf3 triangle::random(const vecf3& o) const {
+    double b1, b2;
+    double r1 = random_double();
+    return sample_point(pointd2(r1, random_double()), b1, b2) - o;
+}
+
+double triangle::sample(const pointf3& o, const pointd2& u, hit_record& rec) const {
+    double b1, b2;
+    pointf3 p = sample_point(u, b1, b2);
+    vecf3 d = p - o;
+    vecf3 n = cross(v1 - v0, v2 - v0);
+    auto distance_squared = d.length_squared();
+    if (distance_squared == 0)
+        return 0;
+    auto cosine = fabs(dot(d, n)) / (sqrt(distance_squared) * n.length());
+    if (cosine == 0)
+        return 0;
+    pointf3 weight = pointf3(1 - b1 - b2, b1, b2);
+    rec.p = p;
+    rec.t = sqrt(distance_squared);
+    get_triangle_uv(weight, rec.u, rec.v);
+    rec.mat_ptr = mat_ptr.get();
+    rec.set_face_normal(ray(o, d), unit_vector(weight.x() * vn1 + weight.y() * vn2 + weight.z() * vn3));
+    return distance_squared / (cosine * area());
+}
+
+pointf3 triangle::sample_point(const pointd2& u, double& b1, double& b2) const {
+    // 重心坐标的均匀采样
+    auto r1 = sqrt(u.x());
+    auto r2 = u.y();
+    b1 = r1 * (1 - r2);
+    b2 = r1 * r2;
+    return (1 - b1 - b2) * v0 + b1 * v1 + b2 * v2;
+}
@@ -0,0 +1,59 @@
+#include "wavefront.h"
+
+void PathBatch::resize(int n) {
+    org_x.resize(n), org_y.resize(n), org_z.resize(n);
+    dir_x.resize(n), dir_y.resize(n), dir_z.resize(n);
+    time.resize(n);
+    beta_r.assign(n, 1.0f), beta_g.assign(n, 1.0f), beta_b.assign(n, 1.0f);
+    L_r.assign(n, 0.0f), L_g.assign(n, 0.0f), L_b.assign(n, 0.0f);
+    emitted_weight.assign(n, 1.0);
+    depth.assign(n, 0);
+    rng.resize(n);
+    rec.resize(n);
+    material_key.resize(n);
+    active.resize(n);
+    for (int i = 0; i < n; i++)
+        active[i] = i;
+    sorted.clear();
+    clearShadow();
+}
+
+void PathBatch::sortByMaterial() {
+    // 没有重载getType的材质放在最后一组
+    constexpr int num_keys = static_cast<int>(material_type::Isotropic) + 2;
+    int count[num_keys + 1] = {0};
+    for (int i: active) {
+        material_type m = static_cast<material_type>(num_keys - 1);
+        rec[i].mat_ptr->getType(m);
+        material_key[i] = static_cast<int>(m);
+        count[material_key[i] + 1]++;
+    }
+    for (int k = 0; k < num_keys; k++)
+        count[k + 1] += count[k];
+    sorted.resize(active.size());
+    for (int i: active)
+        sorted[count[material_key[i]]++] = i;
+}
+
+void PathBatch::pushShadow(int path, const vecf3 &dir, const light_record &ls, const color &factor,
+                           double p_RR, double weight) {
+    shadow_path.push_back(path);
+    shadow_dir_x.push_back(dir.x()), shadow_dir_y.push_back(dir.y()), shadow_dir_z.push_back(dir.z());
+    shadow_dist.push_back(ls.dist);
+    shadow_radiance_r.push_back(ls.radiance.x());
+    shadow_radiance_g.push_back(ls.radiance.y());
+    shadow_radiance_b.push_back(ls.radiance.z());
+    factor_r.push_back(factor.x()), factor_g.push_back(factor.y()), factor_b.push_back(factor.z());
+    shadow_pdf.push_back(ls.pdf);
+    shadow_p_RR.push_back(p_RR);
+    shadow_weight.push_back(weight);
+}
+
+void PathBatch::clearShadow() {
+    shadow_path.clear();
+    shadow_dir_x.clear(), shadow_dir_y.clear(), shadow_dir_z.clear();
+    shadow_dist.clear();
+    shadow_radiance_r.clear(), shadow_radiance_g.clear(), shadow_radiance_b.clear();
+    factor_r.clear(), factor_g.clear(), factor_b.clear();
+    shadow_pdf.clear(), shadow_p_RR.clear(), shadow_weight.clear();
+}
@@ -1,6 +1,25 @@
 #include "RenderEngine.h"
+#include "model.h"
 #include <iostream>
+
+// 检查混合了 v、v/vt、v//vn、v/vt/vn 以及负数下标的面，省略的下标应为absent_index
+bool check_mixed_faces() {
+    mesh_data mesh;
+    if (!load_obj("../data/fixtures/mixed_faces.obj", mesh))
+        return false;
+    const int a = absent_index;
+    const std::vector<int> indices = {0, 2, 3, 0, 1, 2, 1, 4, 5, 4, 6, 5, 3, 4, 6};
+    const std::vector<int> uv_indices = {a, a, a, a, a, a, 0, 1, 2, 0, 1, 2, a, a, a};
+    const std::vector<int> normal_indices = {0, 0, 0, a, a, a, a, a, a, 0, 0, 0, a, a, a};
+    return mesh.positions.size() == 7 && mesh.uvs.size() == 3 && mesh.normals.size() == 1 &&
+           mesh.indices == indices && mesh.uv_indices == uv_indices && mesh.normal_indices == normal_indices;
+}
+
 int main(){
+    if (!check_mixed_faces()) {
+        std::cerr << "mixed_faces.obj: unexpected vt/vn indices" << std::endl;
+        return 1;
+    }
     std::string img_name = "../output/img.png";
     Scene scene;
     cornell_zoom(scene);
@@ -9,4 +28,4 @@ int main(){
     SampleMethod sm = SampleMethod::MIS;
     rayTracer.render(spp, sm, img_name, true);
     return 0;
-}
\ No newline at end of file
+}